@@ -0,0 +1,272 @@
+/*
+ * bench.c - Benchmark DAG, cache, and checksum throughput
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <gcrypt.h>
+
+#include "linzhi/alloc.h"
+#include "linzhi/dag.h"
+#include "linzhi/dagalgo.h"
+#include "linzhi/dagio.h"
+
+#include "sha3.h"
+#include "csum.h"
+#include "pool.h"
+#include "buf.h"
+#include "bench.h"
+
+
+#define	HASH_ROUNDS	16	/* hash each buffer this many times */
+#define	IO_CHUNKS	64	/* size of the file for DAG I/O, in chunks */
+
+
+/*
+ * Output format, one line per measurement:
+ *
+ * test,variant,threads,seconds,rate,unit
+ */
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void result(const char *test, const char *variant, unsigned threads,
+    double t, double rate, const char *unit)
+{
+	printf("%s,%s,%u,%.6f,%.3f,%s\n", test, variant, threads, t, rate,
+	    unit);
+	fflush(stdout);
+}
+
+
+/* ----- Ethash cache ------------------------------------------------------ */
+
+
+static uint8_t *bench_cache(enum dag_algo algo, uint16_t epoch,
+    unsigned cache_bytes)
+{
+	uint8_t seed[SEED_BYTES];
+	uint8_t *cache = buf_huge_alloc(cache_bytes);
+	char variant[20];
+	unsigned i;
+	double t;
+
+	dag_algo = algo;
+	get_seedhash(seed, epoch);
+
+	t = now();
+	mkcache_init(cache, cache_bytes, seed);
+	t = now() - t;
+	result("cache_init", dagalgo_name(algo), 1, t,
+	    cache_bytes / t / 1e6, "MB/s");
+
+	for (i = 0; i != CACHE_ROUNDS; i++) {
+		sprintf(variant, "round%u", i);
+		t = now();
+		mkcache_round(cache, cache_bytes);
+		t = now() - t;
+		result("cache_round", variant, 1, t, cache_bytes / t / 1e6,
+		    "MB/s");
+	}
+	return cache;
+}
+
+
+/* ----- DAG lines --------------------------------------------------------- */
+
+
+struct dataset_job {
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	uint8_t		*buf;
+	uint32_t	lines;
+	unsigned	slices;
+};
+
+
+static void dataset_slice(void *user, unsigned slice)
+{
+	const struct dataset_job *job = user;
+	uint32_t from = (uint64_t) job->lines * slice / job->slices;
+	uint32_t to = (uint64_t) job->lines * (slice + 1) / job->slices;
+
+	calc_dataset_range(job->buf + (size_t) from * DAG_LINE_BYTES, from,
+	    to - from, job->cache, job->cache_bytes);
+}
+
+
+static void bench_dataset(const uint8_t *cache, unsigned cache_bytes)
+{
+	static const unsigned divisors[] = { 16, 4, 1 };
+	struct dataset_job job;
+	char variant[20];
+	unsigned i, threads;
+	double t;
+
+	job.cache = cache;
+	job.cache_bytes = cache_bytes;
+	job.buf = alloc_size(CHUNK_BYTES);
+	for (i = 0; i != sizeof(divisors) / sizeof(*divisors); i++) {
+		job.lines = LINES_PER_CHUNK / divisors[i];
+		sprintf(variant, "%ukB", CHUNK_BYTES / divisors[i] >> 10);
+		for (threads = 1; threads <= pool_threads;
+		    threads = threads == pool_threads ? threads + 1 :
+		    threads * 2 > pool_threads ? pool_threads : threads * 2) {
+			job.slices = threads;
+			t = now();
+			pool_run(dataset_slice, &job, threads);
+			t = now() - t;
+			result("dataset", variant, threads, t, job.lines / t,
+			    "lines/s");
+		}
+	}
+	free(job.buf);
+}
+
+
+/* ----- Chunk hashing ----------------------------------------------------- */
+
+
+static void bench_sha3(void)
+{
+	const char *selected = csum_use_gcrypt ? NULL : sha3_backend();
+	uint8_t digests[SHA3_LANES_MAX][SHA3_256_BYTES];
+	uint8_t *d[SHA3_LANES_MAX];
+	const void *b[SHA3_LANES_MAX];
+	uint8_t *buf;
+	const char *name;
+	unsigned i, n;
+	double t;
+
+	buf = alloc_size((size_t) SHA3_LANES_MAX * CHUNK_BYTES);
+	for (i = 0; i != SHA3_LANES_MAX * CHUNK_BYTES; i++)
+		buf[i] = i * 13;
+	for (i = 0; i != SHA3_LANES_MAX; i++) {
+		d[i] = digests[i];
+		b[i] = buf + (size_t) i * CHUNK_BYTES;
+	}
+
+	for (n = 0; (name = sha3_backend_name(n)); n++) {
+		if (!sha3_select(name))
+			continue;
+		t = now();
+		for (i = 0; i != HASH_ROUNDS; i++)
+			sha3_256_lanes(d, b, CHUNK_BYTES);
+		t = now() - t;
+		result("sha3", name, 1, t,
+		    (double) HASH_ROUNDS * sha3_lanes * CHUNK_BYTES / t / 1e9,
+		    "GB/s");
+	}
+	sha3_select(selected);
+
+	t = now();
+	for (i = 0; i != HASH_ROUNDS; i++)
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256, digests[0], buf,
+		    CHUNK_BYTES);
+	t = now() - t;
+	result("sha3", "gcrypt", 1, t,
+	    (double) HASH_ROUNDS * CHUNK_BYTES / t / 1e9, "GB/s");
+	free(buf);
+}
+
+
+/* ----- DAG file I/O ------------------------------------------------------ */
+
+
+static void bench_io(enum dag_algo algo, uint16_t epoch, const char *dag_fmt)
+{
+	uint32_t lines = IO_CHUNKS * LINES_PER_CHUNK;
+	struct dag_handle *handle;
+	char *path, *name;
+	uint8_t *buf;
+	unsigned i;
+	double t;
+	int fd;
+
+	if (asprintf(&name, dag_fmt, dagalgo_name(algo), epoch) < 0 ||
+	    asprintf(&path, "%s.bench", name) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	free(name);
+	handle = dagio_try_open(path, O_CREAT | O_RDWR | O_TRUNC, lines);
+	if (!handle) {
+		perror(path);
+		exit(1);
+	}
+	buf = alloc_size(CHUNK_BYTES);
+	memset(buf, 0x5a, CHUNK_BYTES);
+
+	/*
+	 * Include writeback in the write time, and make sure the reads come
+	 * from storage and not from the page cache.
+	 */
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	t = now();
+	for (i = 0; i != IO_CHUNKS; i++)
+		dagio_pwrite(handle, buf, LINES_PER_CHUNK,
+		    i * LINES_PER_CHUNK);
+	if (fdatasync(fd) < 0)
+		perror("fdatasync");
+	t = now() - t;
+	result("dagio_pwrite", "1MB", 1, t,
+	    (double) IO_CHUNKS * CHUNK_BYTES / t / 1e6, "MB/s");
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	t = now();
+	for (i = 0; i != IO_CHUNKS; i++)
+		dagio_pread(handle, buf, LINES_PER_CHUNK,
+		    i * LINES_PER_CHUNK);
+	t = now() - t;
+	result("dagio_pread", "1MB", 1, t,
+	    (double) IO_CHUNKS * CHUNK_BYTES / t / 1e6, "MB/s");
+
+	close(fd);
+	dagio_close_and_delete(handle);
+	free(buf);
+	free(path);
+}
+
+
+/* ----- Benchmark --------------------------------------------------------- */
+
+
+void bench(enum dag_algo algo, uint16_t epoch, const char *dag_fmt)
+{
+	unsigned cache_bytes = get_cache_size(epoch);
+	uint8_t *cache;
+
+	printf("test,variant,threads,seconds,rate,unit\n");
+	cache = bench_cache(algo, epoch, cache_bytes);
+	bench_dataset(cache, cache_bytes);
+	buf_huge_free(cache, cache_bytes);
+	bench_sha3();
+	if (dag_fmt)
+		bench_io(algo, epoch, dag_fmt);
+}
@@ -0,0 +1,26 @@
+/*
+ * bench.h - Benchmark DAG, cache, and checksum throughput
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_BENCH_H
+#define	DAGD_BENCH_H
+
+#include <stdint.h>
+
+#include "linzhi/dagalgo.h"
+
+
+/*
+ * bench writes the results as CSV to standard output. If "dag_fmt" is not NULL,
+ * DAG file I/O is measured on a temporary file next to where the DAG of
+ * "epoch" would be.
+ */
+
+void bench(enum dag_algo algo, uint16_t epoch, const char *dag_fmt);
+
+#endif /* !DAGD_BENCH_H */
@@ -0,0 +1,120 @@
+/*
+ * buf.c - Large buffers
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "buf.h"
+
+
+#define	POOL_MAX	2	/* maximum number of idle buffers we keep */
+
+
+static struct idle {
+	uint8_t	*buf;
+	size_t	size;
+} idle[POOL_MAX];
+static unsigned n_idle = 0;
+
+
+/* ----- Huge pages -------------------------------------------------------- */
+
+
+static size_t huge_size(size_t size)
+{
+	return (size + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+}
+
+
+/*
+ * Explicit huge pages (MAP_HUGETLB) are only available if the administrator
+ * has reserved them. Otherwise, we ask for transparent huge pages. These only
+ * cover areas aligned to the huge page size, so we map a huge page more than
+ * we need, and trim the excess at both ends.
+ */
+
+void *buf_huge_alloc(size_t size)
+{
+	static bool warned = 0;
+	size_t n = huge_size(size);
+	uint8_t *p, *aligned;
+
+	p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | HUGE_PAGE_FLAGS, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+	if (!warned) {
+		debug(1, "no explicit huge pages, trying transparent ones");
+		warned = 1;
+	}
+
+	p = mmap(NULL, n + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	aligned = (uint8_t *) huge_size((uintptr_t) p);
+	if (aligned != p)
+		munmap(p, aligned - p);
+	munmap(aligned + n, p + HUGE_PAGE_BYTES - aligned);
+	if (madvise(aligned, n, MADV_HUGEPAGE) < 0)
+		debug(1, "madvise(MADV_HUGEPAGE) failed");
+	return aligned;
+}
+
+
+void buf_huge_free(void *buf, size_t size)
+{
+	if (munmap(buf, huge_size(size)) < 0)
+		perror("munmap");
+}
+
+
+/* ----- Buffer pool ------------------------------------------------------- */
+
+
+uint8_t *buf_get(size_t size)
+{
+	uint8_t *buf;
+	unsigned i;
+
+	for (i = 0; i != n_idle; i++)
+		if (idle[i].size == size) {
+			buf = idle[i].buf;
+			idle[i] = idle[--n_idle];
+			return buf;
+		}
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	debug(1, "buf: new %lu bytes", (unsigned long) size);
+	return buf;
+}
+
+
+void buf_put(uint8_t *buf, size_t size)
+{
+	if (n_idle == POOL_MAX) {
+		if (munmap(buf, size) < 0)
+			perror("munmap");
+		return;
+	}
+	idle[n_idle].buf = buf;
+	idle[n_idle].size = size;
+	n_idle++;
+}
@@ -0,0 +1,51 @@
+/*
+ * buf.h - Large buffers
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_BUF_H
+#define	DAGD_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+
+#ifndef MAP_HUGE_SHIFT
+#define	MAP_HUGE_SHIFT	26	/* also MFD_HUGE_SHIFT */
+#endif
+
+/*
+ * We ask for 2 MB huge pages explicitly, since the system's default huge page
+ * size may be different (e.g., 1 GB), and we round sizes to HUGE_PAGE_BYTES.
+ * HUGE_PAGE_FLAGS is MAP_HUGE_2MB for mmap and MFD_HUGE_2MB for memfd_create.
+ */
+
+#define	HUGE_PAGE_SHIFT	21
+#define	HUGE_PAGE_BYTES	((size_t) 1 << HUGE_PAGE_SHIFT)
+#define	HUGE_PAGE_FLAGS	(HUGE_PAGE_SHIFT << MAP_HUGE_SHIFT)
+
+
+/*
+ * buf_huge_alloc allocates a buffer backed by huge pages, if possible. The
+ * buffer must be freed with buf_huge_free, with the same size. Both functions
+ * can be called from any thread.
+ */
+
+void *buf_huge_alloc(size_t size);
+void buf_huge_free(void *buf, size_t size);
+
+/*
+ * buf_get returns a (page-aligned) buffer of the given size, reusing one
+ * returned with buf_put if possible. These functions must only be called from
+ * the main thread.
+ */
+
+uint8_t *buf_get(size_t size);
+void buf_put(uint8_t *buf, size_t size);
+
+#endif /* !DAGD_BUF_H */
@@ -1,15 +1,24 @@
 /*
  * cache.c - DAG cache stage (not to be confused with the cache of DAG files)
  *
- * Copyright (C) 2021 Linzhi Ltd.
+ * Copyright (C) 2021, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
  */
 
+#define _GNU_SOURCE	/* for asprintf */
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <gcrypt.h>
 
 #include "linzhi/alloc.h"
 #include "linzhi/common.h"
@@ -17,9 +26,226 @@
 #include "linzhi/dagalgo.h"
 
 #include "debug.h"
+#include "buf.h"
 #include "cache.h"
 
 
+/*
+ * A cache file consists of a header, padded to CACHE_FILE_DATA bytes, followed
+ * by the cache. The padding keeps the cache page-aligned.
+ *
+ * We read the cache into a buffer instead of mapping the file, so that it is
+ * backed by huge pages, like a cache we calculate. Calculating dataset lines
+ * reads randomly from all over the cache, and would otherwise spend much of
+ * its time on TLB misses.
+ */
+
+#define	CACHE_FILE_MAGIC	"DAGDLC1"
+#define	CACHE_FILE_DATA		4096
+#define	CACHE_DIGEST_BYTES	32	/* SHA3-256 */
+
+struct cache_file {
+	char		magic[8];	/* CACHE_FILE_MAGIC, NUL-terminated */
+	uint32_t	algo;
+	uint32_t	epoch;
+	uint32_t	bytes;		/* cache size */
+	uint32_t	reserved;	/* 0 */
+	uint8_t		seed_hash[SEED_BYTES];
+	uint8_t		digest[CACHE_DIGEST_BYTES]; /* of the cache */
+};
+
+
+const char *cache_path_template = NULL;
+
+
+/* ----- Cache files ------------------------------------------------------- */
+
+
+static char *cache_path(const struct cache *c)
+{
+	char *path;
+
+	if (asprintf(&path, cache_path_template, dagalgo_name(c->algo),
+	    c->epoch) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return path;
+}
+
+
+static bool read_all(int fd, void *buf, size_t size)
+{
+	ssize_t got;
+
+	while (size) {
+		got = read(fd, buf, size);
+		if (got <= 0)
+			return 0;
+		buf = (uint8_t *) buf + got;
+		size -= got;
+	}
+	return 1;
+}
+
+
+static bool cache_load(struct cache *c)
+{
+	struct cache_file hdr;
+	uint8_t digest[CACHE_DIGEST_BYTES];
+	struct stat st;
+	char *path;
+	uint8_t *buf;
+	ssize_t got;
+	int fd;
+
+	path = cache_path(c);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror(path);
+		free(path);
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		goto fail;
+	}
+	got = read(fd, &hdr, sizeof(hdr));
+	if (got < 0) {
+		perror(path);
+		goto fail;
+	}
+	if (got != sizeof(hdr) ||
+	    st.st_size != (off_t) CACHE_FILE_DATA + c->cache_bytes ||
+	    strcmp(hdr.magic, CACHE_FILE_MAGIC) || hdr.algo != c->algo ||
+	    hdr.epoch != c->epoch || hdr.bytes != c->cache_bytes ||
+	    memcmp(hdr.seed_hash, c->seed_hash, SEED_BYTES)) {
+		fprintf(stderr, "%s: not a cache for %s epoch %u\n", path,
+		    dagalgo_name(c->algo), c->epoch);
+		goto fail;
+	}
+	if (lseek(fd, CACHE_FILE_DATA, SEEK_SET) < 0) {
+		perror(path);
+		goto fail;
+	}
+	buf = buf_huge_alloc(c->cache_bytes);
+	if (!read_all(fd, buf, c->cache_bytes)) {
+		fprintf(stderr, "%s: read error\n", path);
+		buf_huge_free(buf, c->cache_bytes);
+		goto fail;
+	}
+	gcry_md_hash_buffer(GCRY_MD_SHA3_256, digest, buf, c->cache_bytes);
+	if (memcmp(digest, hdr.digest, CACHE_DIGEST_BYTES)) {
+		fprintf(stderr, "%s: bad checksum\n", path);
+		buf_huge_free(buf, c->cache_bytes);
+		goto fail;
+	}
+	debug(1, "cache: loaded %s", path);
+	close(fd);
+	free(path);
+	c->cache = buf;
+	c->stored = 1;
+	return 1;
+
+fail:
+	close(fd);
+	free(path);
+	return 0;
+}
+
+
+static bool write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t wrote;
+
+	while (size) {
+		wrote = write(fd, buf, size);
+		if (wrote < 0)
+			return 0;
+		buf = (const uint8_t *) buf + wrote;
+		size -= wrote;
+	}
+	return 1;
+}
+
+
+/*
+ * We write the cache to a temporary file and then rename it, so that a cache
+ * file is either complete or doesn't exist.
+ */
+
+static bool cache_store(const struct cache *c)
+{
+	uint8_t hdr[CACHE_FILE_DATA];
+	struct cache_file *f = (struct cache_file *) hdr;
+	char *path, *tmp;
+	bool ok = 0;
+	int fd;
+
+	memset(hdr, 0, sizeof(hdr));
+	strcpy(f->magic, CACHE_FILE_MAGIC);
+	f->algo = c->algo;
+	f->epoch = c->epoch;
+	f->bytes = c->cache_bytes;
+	memcpy(f->seed_hash, c->seed_hash, SEED_BYTES);
+	gcry_md_hash_buffer(GCRY_MD_SHA3_256, f->digest, c->cache,
+	    c->cache_bytes);
+
+	path = cache_path(c);
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(tmp);
+		goto out;
+	}
+	if (!write_all(fd, hdr, sizeof(hdr)) ||
+	    !write_all(fd, c->cache, c->cache_bytes)) {
+		perror(tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, path) < 0) {
+		perror(path);
+		unlink(tmp);
+		goto out;
+	}
+	debug(1, "cache: stored %s", path);
+	ok = 1;
+
+out:
+	free(tmp);
+	free(path);
+	return ok;
+}
+
+
+void cache_remove(struct cache *c)
+{
+	char *path;
+
+	if (!c->stored)
+		return;
+	path = cache_path(c);
+	if (unlink(path) < 0 && errno != ENOENT)
+		perror(path);
+	free(path);
+	c->stored = 0;
+}
+
+
+/* ----- Cache generation -------------------------------------------------- */
+
+
 void cache_init(struct cache *c, enum dag_algo algo, uint16_t epoch)
 {
 	c->algo = algo;
@@ -28,40 +254,86 @@ void cache_init(struct cache *c, enum dag_algo algo, uint16_t epoch)
 	c->seed_hash = NULL;
 	c->cache = NULL;
 	c->next_round = 0;
+	c->stored = 0;
+	c->unsaved = 0;
+	if (cache_path_template) {
+		char *path = cache_path(c);
+
+		c->stored = access(path, F_OK) == 0;
+		free(path);
+	}
 	debug(1, "cache: %u bytes", c->cache_bytes);
 }
 
 
+enum cache_io cache_next_io(const struct cache *c)
+{
+	if (!c->seed_hash)
+		return cache_io_none;
+	if (!c->cache)
+		return c->stored ? cache_io_load : cache_io_none;
+	if (c->next_round == CACHE_ROUNDS && c->unsaved)
+		return cache_io_store;
+	return cache_io_none;
+}
+
+
 bool cache_build(struct cache *c)
 {
 	debug(2, "cache_build: %p %p %u",
 	    c->seed_hash, c->cache, c->next_round);
-	dag_algo = c->algo;
 	if (!c->seed_hash) {
 		c->seed_hash = alloc_size(SEED_BYTES);
 		get_seedhash(c->seed_hash, c->epoch);
 		return 1;
 	}
 	if (!c->cache) {
-		c->cache = alloc_size(c->cache_bytes);
+		if (c->stored) {
+			if (cache_load(c))
+				c->next_round = CACHE_ROUNDS;
+			else
+				c->stored = 0;
+			return 1;
+		}
+		/* after cache_evict, we may have to start over */
+		c->next_round = 0;
+		c->cache = buf_huge_alloc(c->cache_bytes);
 		mkcache_init(c->cache, c->cache_bytes, c->seed_hash);
 		return 1;
 	}
 	if (c->next_round != CACHE_ROUNDS) {
 		mkcache_round(c->cache, c->cache_bytes);
 		c->next_round++;
+		c->unsaved = c->next_round == CACHE_ROUNDS &&
+		    cache_path_template;
+		return 1;
+	}
+	if (c->unsaved) {
+		c->stored = cache_store(c);
+		c->unsaved = 0;
 		return 1;
 	}
 	return 0;
 }
 
 
+bool cache_evict(struct cache *c)
+{
+	if (!c->cache || c->next_round != CACHE_ROUNDS || !c->stored)
+		return 0;
+	debug(1, "cache: evict %s epoch %u", dagalgo_name(c->algo), c->epoch);
+	buf_huge_free(c->cache, c->cache_bytes);
+	c->cache = NULL;
+	return 1;
+}
+
+
 void cache_free(struct cache *c)
 {
 	if (c->seed_hash)
 		free(c->seed_hash);
 	if (c->cache)
-		free(c->cache);
+		buf_huge_free(c->cache, c->cache_bytes);
 	c->seed_hash = NULL;
 	c->cache = NULL;
 }
@@ -23,17 +23,57 @@ struct cache {
 	uint8_t		*seed_hash;
 	uint8_t		*cache;
 	uint8_t		next_round;	/* CACHE_ROUNDS if done */
+	bool		stored;		/* cache file exists */
+	bool		unsaved;	/* complete, but not stored yet */
 };
 
 
+/*
+ * File I/O done by the next cache_build step, if any. Loading and storing the
+ * cache file are steps of their own, so that the caller can classify them as
+ * reading and writing work.
+ */
+
+enum cache_io {
+	cache_io_none,
+	cache_io_load,
+	cache_io_store,
+};
+
+
+/*
+ * Printf-style template for the files storing completed caches, with the same
+ * parameters as the DAG file template. NULL if caches are not stored.
+ */
+
+extern const char *cache_path_template;
+
+
 void cache_init(struct cache *c, enum dag_algo algo, uint16_t epoch);
 
 /*
  * cache_build returns 1 if it had to do any work (and more work many need
- * to be done, 0 if the cache was already complete.
+ * to be done, 0 if the cache was already complete. The global dag_algo must
+ * be c->algo. Only the main thread sets it.
  */
 
 bool cache_build(struct cache *c);
+enum cache_io cache_next_io(const struct cache *c);
+
+/*
+ * cache_evict frees a complete cache that is stored in its file, so that
+ * cache_build can load it again later. It returns 1 if it freed the cache.
+ */
+
+bool cache_evict(struct cache *c);
 void cache_free(struct cache *c);
 
+/*
+ * cache_remove removes the stored cache file, if any. Cache files are not
+ * counted in the DAG cache size, so we remove them as soon as the DAG no
+ * longer needs its cache.
+ */
+
+void cache_remove(struct cache *c);
+
 #endif /* !DAGD_CACHE_H */
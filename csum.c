@@ -1,17 +1,22 @@
 /*
  * csum.c - Generate DAG file checksums
  *
- * Copyright (C) 2021 Linzhi Ltd.
+ * Copyright (C) 2021, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
  */
 
+#define _GNU_SOURCE	/* for asprintf */
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <gcrypt.h>
 
@@ -19,13 +24,25 @@
 #include "linzhi/dag.h"
 #include "linzhi/dagalgo.h"
 
+#include "debug.h"
+#include "sha3.h"
+#include "pool.h"
+#include "govern.h"
 #include "csum.h"
 
 
-static gcry_md_hd_t h;
+/*
+ * Self-test lengths around the SHA3-256 block size of 136 bytes, plus a
+ * multi-block one.
+ */
+
+static const size_t test_lengths[] = { 0, 1, 135, 136, 137, 272, 4099 };
 
+bool csum_use_gcrypt = 0;
+unsigned csum_version = 1;
 
-static uint16_t lines_to_chunks(unsigned lines)
+
+uint16_t lines_to_chunks(unsigned lines)
 {
 	return (lines + LINES_PER_CHUNK - 1) / LINES_PER_CHUNK;
 }
@@ -39,56 +56,482 @@ static unsigned lines_in_chunk(uint16_t chunk, unsigned lines)
 }
 
 
-static void init_crypto(void)
+/* ----- Chunk hashing ---------------------------------------------------- */
+
+
+void csum_hash(uint8_t res[CSUM_BYTES], const void *buf, size_t len)
+{
+	uint8_t digest[SHA3_256_BYTES];
+
+	if (csum_use_gcrypt)
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256, digest, buf, len);
+	else
+		sha3_256(digest, buf, len);
+	memcpy(res, digest, CSUM_BYTES);
+}
+
+
+void csum_hash_multi(uint8_t *const res[], const void *const buf[],
+    const size_t len[], unsigned n)
+{
+	uint8_t digests[SHA3_LANES_MAX][SHA3_256_BYTES];
+	uint8_t *d[SHA3_LANES_MAX];
+	const void *b[SHA3_LANES_MAX];
+	unsigned i, j, lanes;
+
+	if (csum_use_gcrypt || sha3_lanes == 1) {
+		for (i = 0; i != n; i++)
+			csum_hash(res[i], buf[i], len[i]);
+		return;
+	}
+
+	/*
+	 * Hash groups of sha3_lanes buffers of equal length together. Whatever
+	 * doesn't fit into a group (e.g., the short last chunk of a DAG) is
+	 * hashed on its own.
+	 */
+	for (i = 0; i != n; i += lanes) {
+		for (lanes = 1; lanes != sha3_lanes && i + lanes != n; lanes++)
+			if (len[i + lanes] != len[i])
+				break;
+		if (lanes != sha3_lanes) {
+			csum_hash(res[i], buf[i], len[i]);
+			lanes = 1;
+			continue;
+		}
+		for (j = 0; j != lanes; j++) {
+			d[j] = digests[j];
+			b[j] = buf[i + j];
+		}
+		sha3_256_lanes(d, b, len[i]);
+		for (j = 0; j != lanes; j++)
+			memcpy(res[i + j], digests[j], CSUM_BYTES);
+	}
+}
+
+
+unsigned csum_lanes(void)
+{
+	return csum_use_gcrypt ? 1 : sha3_lanes;
+}
+
+
+/* ----- Initialization ---------------------------------------------------- */
+
+
+/*
+ * Cross-check the built-in SHA3 implementation against libgcrypt, with each
+ * lane hashing different data.
+ */
+
+static bool self_test(void)
+{
+	uint8_t data[SHA3_LANES_MAX][4099];
+	uint8_t ref[SHA3_256_BYTES];
+	uint8_t digests[SHA3_LANES_MAX][SHA3_256_BYTES];
+	uint8_t *d[SHA3_LANES_MAX];
+	const void *b[SHA3_LANES_MAX];
+	unsigned i, j, k;
+
+	for (j = 0; j != SHA3_LANES_MAX; j++) {
+		for (k = 0; k != sizeof(data[j]); k++)
+			data[j][k] = k * 7 + j;
+		d[j] = digests[j];
+		b[j] = data[j];
+	}
+	for (i = 0; i != sizeof(test_lengths) / sizeof(*test_lengths); i++) {
+		size_t len = test_lengths[i];
+
+		sha3_256_lanes(d, b, len);
+		for (j = 0; j != sha3_lanes; j++) {
+			gcry_md_hash_buffer(GCRY_MD_SHA3_256, ref, data[j],
+			    len);
+			if (memcmp(ref, digests[j], SHA3_256_BYTES))
+				return 0;
+		}
+		sha3_256(digests[0], data[0], len);
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256, ref, data[0], len);
+		if (memcmp(ref, digests[0], SHA3_256_BYTES))
+			return 0;
+	}
+	return 1;
+}
+
+
+void csum_init(const char *backend)
 {
-	gcry_error_t err;
+	static bool initialized = 0;
+
+	if (initialized)
+		return;
+	initialized = 1;
 
 	gcry_check_version(NULL);
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
-	err = gcry_md_open(&h, GCRY_MD_SHA3_256, 0);
-	if (err) {
-		fprintf(stderr, "gcry_md_open: %s\n", gcry_strerror(err));
+
+	if (backend && !strcmp(backend, "gcrypt")) {
+		csum_use_gcrypt = 1;
+		return;
+	}
+	if (!sha3_select(backend)) {
+		fprintf(stderr, "SHA3 backend \"%s\" is not available\n",
+		    backend);
 		exit(1);
 	}
+	if (!self_test()) {
+		fprintf(stderr,
+		    "warning: SHA3 backend \"%s\" failed self-test, "
+		    "using libgcrypt\n", sha3_backend());
+		csum_use_gcrypt = 1;
+		return;
+	}
+	debug(1, "SHA3 backend %s, %u lane%s", sha3_backend(), sha3_lanes,
+	    sha3_lanes == 1 ? "" : "s");
 }
 
 
-void csum_generate(enum dag_algo algo, uint16_t epoch)
+/* ----- Checksum file format --------------------------------------------- */
+
+
+/*
+ * Version 1 of the checksum file format is just the checksums of the chunks,
+ * CSUM_BYTES each. Version 2 adds a header before the checksums that describes
+ * them, and the root of a Merkle tree over the checksums.
+ *
+ * The leaves of the Merkle tree are SHA3-256(0x00 || checksum), inner nodes
+ * are SHA3-256(0x01 || left || right). If a level has an odd number of nodes,
+ * the last one moves up unchanged. The inner nodes are not stored, since they
+ * are quickly recalculated from the checksums.
+ */
+
+#define	CSUM_MAGIC		"DAGCSUM"
+#define	CSUM_DIGEST_SHA3_256	1	/* truncated SHA3-256 */
+
+struct csum_header {
+	char		magic[8];	/* CSUM_MAGIC, NUL-terminated */
+	uint16_t	version;	/* 2 */
+	uint16_t	digest;		/* CSUM_DIGEST_* */
+	uint16_t	algo;
+	uint16_t	epoch;
+	uint32_t	chunk_bytes;
+	uint32_t	chunks;
+	uint32_t	csum_bytes;	/* bytes per checksum */
+	uint32_t	reserved;	/* 0 */
+	uint8_t		root[SHA3_256_BYTES]; /* Merkle root */
+};
+
+
+static void merkle_root(uint8_t root[SHA3_256_BYTES], const uint8_t *csums,
+    unsigned chunks)
 {
-	uint8_t seed[SEED_BYTES];
-	unsigned cache_bytes = get_cache_size(epoch);
-	unsigned full_lines = get_full_lines(epoch);
-	unsigned chunks = lines_to_chunks(full_lines);
-	uint8_t *cache = alloc_size(cache_bytes);
-	uint8_t *chunk = alloc_size(CHUNK_BYTES);
+	uint8_t *nodes = alloc_size((size_t) (chunks ? chunks : 1) *
+	    SHA3_256_BYTES);
+	uint8_t tmp[1 + 2 * SHA3_256_BYTES];
+	unsigned n, i;
+
+	tmp[0] = 0;
+	for (i = 0; i != chunks; i++) {
+		memcpy(tmp + 1, csums + (size_t) i * CSUM_BYTES, CSUM_BYTES);
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256,
+		    nodes + (size_t) i * SHA3_256_BYTES, tmp, 1 + CSUM_BYTES);
+	}
+	if (!chunks)
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256, nodes, tmp, 1);
+
+	tmp[0] = 1;
+	for (n = chunks; n > 1; n = (n + 1) / 2)
+		for (i = 0; i != n; i += 2) {
+			uint8_t *to = nodes + (size_t) i / 2 * SHA3_256_BYTES;
+			const uint8_t *left = nodes + (size_t) i * SHA3_256_BYTES;
+
+			if (i + 1 == n) {
+				memmove(to, left, SHA3_256_BYTES);
+				break;
+			}
+			memcpy(tmp + 1, left, 2 * SHA3_256_BYTES);
+			gcry_md_hash_buffer(GCRY_MD_SHA3_256, to, tmp,
+			    sizeof(tmp));
+		}
+	memcpy(root, nodes, SHA3_256_BYTES);
+	free(nodes);
+}
+
+
+static void csum_header(struct csum_header *h, enum dag_algo algo,
+    uint16_t epoch, const uint8_t *csums, unsigned chunks)
+{
+	memset(h, 0, sizeof(*h));
+	strcpy(h->magic, CSUM_MAGIC);
+	h->version = 2;
+	h->digest = CSUM_DIGEST_SHA3_256;
+	h->algo = algo;
+	h->epoch = epoch;
+	h->chunk_bytes = CHUNK_BYTES;
+	h->chunks = chunks;
+	h->csum_bytes = CSUM_BYTES;
+	merkle_root(h->root, csums, chunks);
+}
+
+
+static bool csum_check_header(const char *path, const struct csum_header *h,
+    enum dag_algo algo, uint16_t epoch, unsigned chunks)
+{
+	uint8_t root[SHA3_256_BYTES];
+
+	if (h->version != 2 || h->digest != CSUM_DIGEST_SHA3_256 ||
+	    h->chunk_bytes != CHUNK_BYTES || h->csum_bytes != CSUM_BYTES) {
+		fprintf(stderr,
+		    "%s: unsupported format (version %u, digest %u, "
+		    "chunk %u bytes, checksum %u bytes)\n", path, h->version,
+		    h->digest, h->chunk_bytes, h->csum_bytes);
+		return 0;
+	}
+	if (h->algo != algo || h->epoch != epoch || h->chunks != chunks) {
+		fprintf(stderr, "%s: checksums are for %s epoch %u (%u chunks)\n",
+		    path, dagalgo_name(h->algo), h->epoch, h->chunks);
+		return 0;
+	}
+	merkle_root(root, (const uint8_t *) (h + 1), chunks);
+	if (memcmp(root, h->root, SHA3_256_BYTES)) {
+		fprintf(stderr, "%s: Merkle root mismatch\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+
+uint8_t *csum_load(const char *path, enum dag_algo algo, uint16_t epoch,
+    unsigned lines)
+{
+	unsigned chunks = lines_to_chunks(lines);
+	size_t v1_size = (size_t) chunks * CSUM_BYTES;
+	size_t v2_size = sizeof(struct csum_header) + v1_size;
+	uint8_t *buf = NULL;
+	struct stat st;
+	size_t pos = 0;
+	ssize_t got;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		goto fail;
+	}
+	if (st.st_size != (off_t) v1_size && st.st_size != (off_t) v2_size) {
+		fprintf(stderr, "%s: %llu bytes instead of %llu or %llu\n",
+		    path, (unsigned long long) st.st_size,
+		    (unsigned long long) v1_size, (unsigned long long) v2_size);
+		goto fail;
+	}
+	buf = alloc_size(st.st_size);
+	while (pos != (size_t) st.st_size) {
+		got = read(fd, buf + pos, st.st_size - pos);
+		if (got <= 0) {
+			if (got < 0)
+				perror(path);
+			else
+				fprintf(stderr, "%s: file shrank\n", path);
+			goto fail;
+		}
+		pos += got;
+	}
+	close(fd);
+
+	if (st.st_size == (off_t) v1_size)
+		return buf;
+	if (strcmp((const char *) buf, CSUM_MAGIC)) {
+		fprintf(stderr, "%s: bad magic\n", path);
+		free(buf);
+		return NULL;
+	}
+	if (!csum_check_header(path, (const struct csum_header *) buf, algo,
+	    epoch, chunks)) {
+		free(buf);
+		return NULL;
+	}
+	debug(1, "%s: version 2", path);
+	memmove(buf, buf + sizeof(struct csum_header), v1_size);
+	return buf;
+
+fail:
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+
+/* ----- Checksum file generation ------------------------------------------ */
+
+
+/*
+ * Chunks are generated in batches of one group of csum_lanes() chunks per pool
+ * thread. Each job calculates the chunks of its group into its own buffers and
+ * hashes them together.
+ */
+
+struct gen_job {
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	unsigned	full_lines;
+	unsigned	first;	/* first chunk of the batch */
+	unsigned	chunks;	/* chunks in the batch */
+	uint8_t		*buf;	/* one chunk buffer per chunk in the batch */
+	uint8_t		*csums;	/* checksums of the whole epoch */
+};
+
+
+static void gen_group(void *user, unsigned group)
+{
+	const struct gen_job *job = user;
+	uint8_t *r[SHA3_LANES_MAX];
+	const void *b[SHA3_LANES_MAX];
+	size_t len[SHA3_LANES_MAX];
+	unsigned first = group * csum_lanes();
+	unsigned n = job->chunks - first;
 	unsigned i;
 
-	init_crypto();
-	dag_algo = algo;
-	get_seedhash(seed, epoch);
-	mkcache(cache, cache_bytes, seed);
+	if (n > csum_lanes())
+		n = csum_lanes();
+	for (i = 0; i != n; i++) {
+		unsigned chunk = job->first + first + i;
+		unsigned lines = lines_in_chunk(chunk, job->full_lines);
+		uint8_t *buf = job->buf + (size_t) (first + i) * CHUNK_BYTES;
 
-	for (i = 0; i != chunks; i++) {
-		unsigned lines = lines_in_chunk(i, full_lines);
-		unsigned char *res;
-		ssize_t wrote;
-
-		calc_dataset_range(chunk, i * LINES_PER_CHUNK, lines,
-		    cache, cache_bytes);
-		gcry_md_reset(h);
-		gcry_md_write(h, chunk, lines * DAG_LINE_BYTES);
-		res = gcry_md_read(h, GCRY_MD_SHA3_256);
-		wrote = write(1, res, CSUM_BYTES);
+		calc_dataset_range(buf, chunk * LINES_PER_CHUNK, lines,
+		    job->cache, job->cache_bytes);
+		r[i] = job->csums + (size_t) chunk * CSUM_BYTES;
+		b[i] = buf;
+		len[i] = (size_t) lines * DAG_LINE_BYTES;
+	}
+	csum_hash_multi(r, b, len, n);
+}
+
+
+static void write_csums(int fd, const char *name, const uint8_t *csums,
+    size_t size)
+{
+	ssize_t wrote;
+
+	while (size) {
+		wrote = write(fd, csums, size);
 		if (wrote < 0) {
-			perror("write");
+			perror(name);
 			exit(1);
 		}
-		if (wrote != CSUM_BYTES) {
-			fprintf(stderr, "short write: %u < %u\n",
-			    (unsigned) wrote, CSUM_BYTES);
+		if (!wrote) {
+			fprintf(stderr, "%s: short write\n", name);
 			exit(1);
 		}
+		csums += wrote;
+		size -= wrote;
 	}
+}
+
+
+/*
+ * Write the checksums to a temporary file and rename it, so that an
+ * interrupted run doesn't leave incomplete checksum files behind.
+ */
+
+static void store_csums(const char *fmt, enum dag_algo algo, uint16_t epoch,
+    const uint8_t *csums, size_t size)
+{
+	char *path, *tmp;
+	int fd;
+
+	if (asprintf(&path, fmt, dagalgo_name(algo), epoch) < 0 ||
+	    asprintf(&tmp, "%s.tmp", path) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(tmp);
+		exit(1);
+	}
+	write_csums(fd, tmp, csums, size);
+	if (close(fd) < 0) {
+		perror(tmp);
+		exit(1);
+	}
+	if (rename(tmp, path) < 0) {
+		perror(path);
+		exit(1);
+	}
+	debug(0, "%s", path);
+	free(tmp);
+	free(path);
+}
+
+
+static void generate_epoch(enum dag_algo algo, uint16_t epoch,
+    uint8_t *cache, uint8_t *buf, const char *fmt)
+{
+	uint8_t seed[SEED_BYTES];
+	unsigned batch = pool_threads * csum_lanes();
+	struct gen_job job;
+	unsigned chunks;
+	uint8_t *file;
+	size_t size;
+
+	debug(0, "%s epoch %u", dagalgo_name(algo), epoch);
+	job.cache = cache;
+	job.cache_bytes = get_cache_size(epoch);
+	job.full_lines = get_full_lines(epoch);
+	job.buf = buf;
+	chunks = lines_to_chunks(job.full_lines);
+	size = (csum_version == 2 ? sizeof(struct csum_header) : 0) +
+	    (size_t) chunks * CSUM_BYTES;
+	file = alloc_size(size);
+	job.csums = file + size - (size_t) chunks * CSUM_BYTES;
+
+	dag_algo = algo;
+	get_seedhash(seed, epoch);
+	mkcache(cache, job.cache_bytes, seed);
+
+	for (job.first = 0; job.first < chunks; job.first += batch) {
+		job.chunks = chunks - job.first < batch ?
+		    chunks - job.first : batch;
+		pool_run(gen_group, &job,
+		    (job.chunks + csum_lanes() - 1) / csum_lanes());
+		govern_sleep(govern_idle);
+	}
+
+	if (csum_version == 2)
+		csum_header((struct csum_header *) file, algo, epoch,
+		    job.csums, chunks);
+	if (fmt)
+		store_csums(fmt, algo, epoch, file, size);
+	else
+		write_csums(1, "stdout", file, size);
+	free(file);
+}
+
+
+void csum_generate(const struct gen_range *ranges, unsigned n,
+    const char *fmt)
+{
+	const struct gen_range *r;
+	unsigned cache_bytes = 0;
+	uint8_t *cache, *buf;
+	uint16_t epoch;
+
+	/* the cache grows with the epoch, but let's not rely on this */
+	for (r = ranges; r != ranges + n; r++)
+		for (epoch = r->from; epoch <= r->to; epoch++)
+			if (get_cache_size(epoch) > cache_bytes)
+				cache_bytes = get_cache_size(epoch);
+	cache = alloc_size(cache_bytes);
+	buf = alloc_size((size_t) pool_threads * csum_lanes() * CHUNK_BYTES);
+
+	for (r = ranges; r != ranges + n; r++)
+		for (epoch = r->from; epoch <= r->to; epoch++)
+			generate_epoch(r->algo, epoch, cache, buf, fmt);
+
 	free(cache);
-	free(chunk);
+	free(buf);
 }
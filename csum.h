@@ -10,6 +10,8 @@
 #ifndef DAGD_CSUM_H
 #define	DAGD_CSUM_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "linzhi/dag.h"
@@ -21,6 +23,67 @@
 #define	CSUM_BYTES	8
 
 
-void csum_generate(enum dag_algo algo, uint16_t epoch);
+/*
+ * Use libgcrypt instead of the built-in SHA3-256. This is mainly meant as a
+ * reference for cross-checking the built-in backends.
+ */
+
+extern bool csum_use_gcrypt;
+
+/*
+ * Version of the checksum file format written by csum_generate, 1 or 2.
+ * csum_load reads both.
+ */
+
+extern unsigned csum_version;
+
+
+/*
+ * Number of chunks (and thus checksums) of a DAG with "lines" lines.
+ */
+
+uint16_t lines_to_chunks(unsigned lines);
+
+/*
+ * csum_hash and csum_hash_multi can be called concurrently from several
+ * threads. csum_hash_multi hashes "n" buffers, using parallel lanes where
+ * possible. csum_lanes is the number of buffers hashed in parallel.
+ */
+
+void csum_hash(uint8_t res[CSUM_BYTES], const void *buf, size_t len);
+void csum_hash_multi(uint8_t *const res[], const void *const buf[],
+    const size_t len[], unsigned n);
+unsigned csum_lanes(void);
+
+/*
+ * csum_load reads and validates the checksum file of a DAG with "lines" lines.
+ * It returns the checksums, CSUM_BYTES per chunk, or NULL if the file is
+ * missing or not valid for the DAG. The caller has to free the buffer.
+ */
+
+uint8_t *csum_load(const char *path, enum dag_algo algo, uint16_t epoch,
+    unsigned lines);
+
+/*
+ * csum_generate generates the checksums for the "n" epoch ranges in "ranges",
+ * using the thread pool. If "fmt" is NULL, the checksums are written to
+ * standard output. Otherwise, "fmt" is a template for the paths of the
+ * checksum files, like the csum-fmt argument of dagd.
+ */
+
+struct gen_range {
+	enum dag_algo	algo;
+	uint16_t	from, to;	/* inclusive */
+};
+
+void csum_generate(const struct gen_range *ranges, unsigned n,
+    const char *fmt);
+
+/*
+ * csum_init initializes libgcrypt and selects the SHA3 backend: "gcrypt", the
+ * name of a built-in backend, or NULL for the best built-in one.
+ */
+
+void csum_init(const char *backend);
 
 #endif /* !DAGD_CSUM_H */
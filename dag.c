@@ -11,126 +11,601 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
 #include <assert.h>
-
-#include <gcrypt.h>
+#include <sys/mman.h>
 
 #include "linzhi/alloc.h"
 #include "linzhi/dag.h"
 #include "linzhi/dagio.h"
 
 #include "debug.h"
+#include "sha3.h"
 #include "csum.h"
+#include "pool.h"
+#include "io.h"
+#include "prefetch.h"
+#include "range.h"
+#include "metrics.h"
+#include "buf.h"
+#include "govern.h"
 #include "dag.h"
 
 
+#define	GEN_LINES_MIN	256	/* smallest generation unit */
+#define	SAMPLE_CHUNKS	16	/* random chunks checked for fast start */
+
+
+bool mmap_verify = 0;
+unsigned latency_ms = 200;
+
+/*
+ * Size of the next work unit: lines to generate, and chunks to verify. Both
+ * adapt to how long the previous unit took, see adapt().
+ */
+
+static uint32_t gen_lines = LINES_PER_CHUNK;
+static unsigned check_max = 0;	/* 0 means batch_max() */
+
+/*
+ * Only the epoch we worked on last holds a chunk buffer. When we switch to
+ * another epoch, the buffer goes back to the pool, so memory use does not grow
+ * with the number of epochs we are working on.
+ */
+
+static struct epoch *holder = NULL;
+
+
+static uint32_t chunk_lines(const struct epoch *e, uint32_t pos)
+{
+	return pos + LINES_PER_CHUNK > e->lines ?
+	    e->lines - pos : LINES_PER_CHUNK;
+}
+
+
+/*
+ * The lines of a chunk are split into one slice per pool thread. The light
+ * cache is only read, and each slice goes to a separate part of the chunk
+ * buffer, so the slices can be calculated concurrently. Writing the chunk is
+ * left to the main thread, so DAG writes stay in order.
+ */
+
+struct slice_job {
+	struct epoch	*e;
+	uint8_t		*buf;
+	uint32_t	pos;	/* first line of the work unit */
+	uint32_t	lines;	/* lines in the work unit */
+	unsigned	slices;
+};
+
+
 /*
- * @@@ If we want to have finer granularity than a chunk at a time AND want
- * to be able to change between epochs (or check them in parallel), we'll need
- * one gcrypt context per epoch, not one shared among them all.
+ * With asynchronous I/O, the chunk buffer is split into IO_SLOTS parts, so
+ * that one part can be read or written while we work on the other.
+ */
+
+static unsigned io_slots(void)
+{
+	return io_async ? IO_SLOTS : 1;
+}
+
+
+/*
+ * Maximum number of chunks in a verification batch: one group of chunks that
+ * are hashed in parallel lanes for each pool thread.
+ */
+
+static unsigned batch_max(void)
+{
+	return pool_threads * csum_lanes();
+}
+
+
+/*
+ * One call to work_on should take about latency_ms, so that the main loop gets
+ * to service MQTT and report status regularly even on slow CPUs, while fast
+ * CPUs can work on larger units, which are more efficient.
  *
- * If, on the other hand, we stay with the current approach, we could also have
- * a single shared chunk buffer.
+ * If a unit took more than twice the target time, we halve the size of the
+ * next one, and if it took less than half the target, we double it. Between
+ * these limits, the size stays the same, so that read-ahead usually matches
+ * the next verification batch.
  */
 
-static gcry_md_hd_t h;
+static unsigned adapt(unsigned n, unsigned min, unsigned max, uint64_t t0)
+{
+	uint64_t t = now_us() - t0;
+	uint64_t target = (uint64_t) latency_ms * 1000;
+
+	if (!latency_ms)
+		return n;
+	if (t > 2 * target && n > min)
+		n = n / 2 < min ? min : n / 2;
+	else if (2 * t < target && n < max)
+		n = n * 2 > max ? max : n * 2;
+	return n;
+}
+
+
+static size_t chunk_buf_bytes(void)
+{
+	return (size_t) io_slots() * batch_max() * CHUNK_BYTES;
+}
+
+
+static uint8_t *slot_buf(const struct epoch *e, unsigned slot)
+{
+	return e->chunk + (size_t) slot * batch_max() * CHUNK_BYTES;
+}
+
+
+static void calc_slice(void *user, unsigned slice)
+{
+	const struct slice_job *job = user;
+	const struct epoch *e = job->e;
+	uint32_t from = (uint64_t) job->lines * slice / job->slices;
+	uint32_t to = (uint64_t) job->lines * (slice + 1) / job->slices;
+
+	if (from == to)
+		return;
+	calc_dataset_range(job->buf + (size_t) from * DAG_LINE_BYTES,
+	    job->pos + from, to - from, e->cache.cache, e->cache.cache_bytes);
+}
 
 
 /*
- * @@@ We assume that the first checksum error we hit indicates that the rest
- * of the file needs to be calculated.
+ * Generate up to "max_lines" lines at "pos" and write them to the DAG file.
+ * Returns the number of lines generated.
+ *
+ * Generation is not bound to chunks: a unit can be smaller or larger than a
+ * chunk, up to the size of an I/O slot.
  */
 
-static bool generate_chunk(struct epoch *e)
+static uint32_t generate(struct epoch *e, uint32_t pos, uint32_t max_lines)
 {
+	struct io_req *req = &e->io[e->slot];
+	struct slice_job job;
 	uint32_t want_lines;
+	uint64_t t0 = now_us();
 
-	/*
-	 * @@@ Should adjust number of lines we calculate to CPU speed.
-	 */
-	debug(2, "generating chunk %u of epoch %u",
-	    e->pos / LINES_PER_CHUNK, e->num);
+	want_lines = gen_lines < max_lines ? gen_lines : max_lines;
 
-	want_lines = e->pos + LINES_PER_CHUNK > e->lines ?
-	    e->lines - e->pos : LINES_PER_CHUNK;
+	debug(2, "generating lines %u-%u (chunk %u) of epoch %u",
+	    pos, pos + want_lines - 1, pos / LINES_PER_CHUNK, e->num);
 
 	debug(2, "%u lines, %lu bytes", want_lines,
 	    (unsigned long) want_lines * DAG_LINE_BYTES);
 
-	calc_dataset_range(e->chunk, e->pos, want_lines,
-	    e->cache.cache, e->cache.cache_bytes);
-	dagio_pwrite(e->dag_handle, e->chunk, want_lines, e->pos);
-	e->pos += want_lines;
-	return 1;
+	/* the previous write from this buffer must have completed */
+	io_wait(req);
+
+	job.e = e;
+	job.buf = slot_buf(e, e->slot);
+	job.pos = pos;
+	job.lines = want_lines;
+	job.slices = pool_threads;
+	pool_run(calc_slice, &job, job.slices);
+
+	req->handle = e->dag_handle;
+	req->buf = job.buf;
+	req->lines = want_lines;
+	req->pos = pos;
+	req->write = 1;
+	io_submit(req);
+	e->slot = (e->slot + 1) % io_slots();
+
+	metrics_gen(want_lines, now_us() - t0);
+	govern_io(1, (uint64_t) want_lines * DAG_LINE_BYTES);
+	gen_lines = adapt(gen_lines, GEN_LINES_MIN,
+	    batch_max() * LINES_PER_CHUNK, t0);
+	return want_lines;
 }
 
 
-static bool check_chunk(struct epoch *e)
+/*
+ * Verification works on a batch of chunks at a time. Each pool job reads and
+ * hashes a group of csum_lanes() chunks, using its own part of the buffer, so
+ * reading in one job overlaps with hashing in the others. Chunks that don't
+ * match their checksum are added to e->bad, and verification continues after
+ * them.
+ *
+ * With asynchronous I/O, the next batch is read ahead while we hash the
+ * current one.
+ */
+
+struct check_job {
+	struct epoch	*e;
+	uint8_t		*buf;
+	unsigned	chunks;	/* chunks in the batch */
+	bool		loaded;	/* buffer already contains the chunks */
+	bool		ok[];	/* one entry per chunk */
+};
+
+
+static void check_group(void *user, unsigned group)
 {
-	uint8_t ref[CSUM_BYTES];
-	unsigned char *res;
-	unsigned chunk;
-	uint32_t want_lines;
-	ssize_t got;
+	struct check_job *job = user;
+	struct epoch *e = job->e;
+	unsigned first = group * csum_lanes();
+	unsigned n = job->chunks - first;
+	const uint8_t *ref[SHA3_LANES_MAX];
+	uint8_t res[SHA3_LANES_MAX][CSUM_BYTES];
+	uint8_t *r[SHA3_LANES_MAX];
+	const void *b[SHA3_LANES_MAX];
+	size_t len[SHA3_LANES_MAX];
+	unsigned i;
 
-	if (e->csum_fd < 0)
-		return 0;
-	chunk = e->pos / LINES_PER_CHUNK;
-	debug(2, "checking chunk %u of epoch %u", chunk, e->num);
-	got = pread(e->csum_fd, ref, CSUM_BYTES, (off_t) chunk * CSUM_BYTES);
-	if (got < 0) {
-		perror("checksum read");
-		return 0;
+	if (n > csum_lanes())
+		n = csum_lanes();
+	for (i = 0; i != n; i++) {
+		uint32_t pos = e->pos + (first + i) * LINES_PER_CHUNK;
+		uint8_t *buf = job->buf + (size_t) (first + i) * CHUNK_BYTES;
+		unsigned chunk = pos / LINES_PER_CHUNK;
+		uint32_t want_lines = chunk_lines(e, pos);
+
+		r[i] = res[i];
+		b[i] = buf;
+		len[i] = (size_t) want_lines * DAG_LINE_BYTES;
+		ref[i] = e->csum + (size_t) chunk * CSUM_BYTES;
+
+		debug(2, "checking chunk %u of epoch %u", chunk, e->num);
+
+		debug(2, "%u lines, %lu bytes", want_lines,
+		    (unsigned long) want_lines * DAG_LINE_BYTES);
+		if (!job->loaded)
+			dagio_pread(e->dag_handle, buf, want_lines, pos);
 	}
-	if (got != CSUM_BYTES) {
-		fprintf(stderr, "checksum: got %lu instead of %u bytes\n",
-		    (unsigned long) got, CSUM_BYTES);
-		return 0;
+
+	csum_hash_multi(r, b, len, n);
+
+	for (i = 0; i != n; i++) {
+		debug(2, "got %02x%02x%02x..., expected %02x%02x%02x...",
+		    res[i][0], res[i][1], res[i][2],
+		    ref[i][0], ref[i][1], ref[i][2]);
+		job->ok[first + i] = !memcmp(res[i], ref[i], CSUM_BYTES);
 	}
+}
 
-	want_lines = e->pos + LINES_PER_CHUNK > e->lines ?
-	    e->lines - e->pos : LINES_PER_CHUNK;
-	debug(2, "%u lines, %lu bytes", want_lines,
-	    (unsigned long) want_lines * DAG_LINE_BYTES);
-	dagio_pread(e->dag_handle, e->chunk, want_lines, e->pos);
-
-	gcry_md_reset(h);
-	gcry_md_write(h, e->chunk, (size_t) want_lines * DAG_LINE_BYTES);
-	res = gcry_md_read(h, GCRY_MD_SHA3_256);
-	debug(2, "got %02x%02x%02x..., expected %02x%02x%02x...",
-	    res[0], res[1], res[2], ref[0], ref[1], ref[2]);
-	if (memcmp(res, ref, CSUM_BYTES))
+
+/*
+ * A chunk can be verified if it is completely in the file, or if it is the
+ * last (partial) chunk of a complete file.
+ */
+
+static bool may_check(const struct epoch *e, uint32_t pos)
+{
+	return pos + LINES_PER_CHUNK <= e->nominal || e->nominal == e->lines;
+}
+
+
+/*
+ * Number of chunks in the batch starting at "pos". Sets *lines to the total
+ * number of lines in the batch. Batches always consist of whole chunks, since
+ * each checksum covers one chunk.
+ */
+
+static unsigned batch_chunks(const struct epoch *e, uint32_t pos,
+    uint32_t *lines)
+{
+	unsigned chunks = 0;
+
+	if (!check_max || check_max > batch_max())
+		check_max = batch_max();
+	*lines = 0;
+	while (chunks != check_max && pos < e->lines && may_check(e, pos)) {
+		*lines += chunk_lines(e, pos);
+		pos += chunk_lines(e, pos);
+		chunks++;
+	}
+	return chunks;
+}
+
+
+static void read_ahead(struct epoch *e, uint32_t pos, unsigned slot)
+{
+	struct io_req *req = &e->io[slot];
+	uint32_t lines;
+
+	if (!batch_chunks(e, pos, &lines))
+		return;
+	io_wait(req);
+	req->handle = e->dag_handle;
+	req->buf = slot_buf(e, slot);
+	req->lines = lines;
+	req->pos = pos;
+	req->write = 0;
+	io_submit(req);
+}
+
+
+/*
+ * Select the part of the buffer for a batch of "lines" lines at e->pos. If the
+ * batch has been read ahead, *loaded is set to 1. Otherwise, the chunks are
+ * read by check_group.
+ */
+
+static uint8_t *batch_buf(struct epoch *e, uint32_t lines, bool *loaded)
+{
+	struct io_req *req;
+	unsigned slot = e->slot;
+	unsigned i;
+
+	*loaded = 0;
+	for (i = 0; i != io_slots(); i++) {
+		req = &e->io[i];
+		if (!req->write && req->pos == e->pos && req->lines == lines) {
+			slot = i;
+			*loaded = 1;
+			break;
+		}
+	}
+	req = &e->io[slot];
+	io_wait(req);
+	req->lines = 0;
+	e->slot = slot;
+
+	if (io_slots() > 1)
+		read_ahead(e, e->pos + lines, (slot + 1) % io_slots());
+
+	return slot_buf(e, slot);
+}
+
+
+/*
+ * With mmap_verify, we hash the batch directly from the page cache instead of
+ * copying it into our buffer. This assumes that the DAG file contains nothing
+ * but the DAG lines, starting at offset zero. Since e->pos is at a chunk
+ * boundary, the batch is page-aligned. Since libdag may store DAGs
+ * differently, we compare the first chunk we map with what libdag reads, and
+ * turn mmap_verify off if they differ.
+ *
+ * We only map one batch at a time, which also works on 32-bit systems, and we
+ * drop the pages once we're done with them, so that verifying a DAG doesn't
+ * push other data out of the page cache.
+ */
+
+static uint8_t *map_batch(struct epoch *e, uint32_t lines)
+{
+	static bool layout_checked = 0;
+	size_t size = (size_t) lines * DAG_LINE_BYTES;
+	void *map;
+
+	if (e->map_fd < 0) {
+		e->map_fd = open(e->path, O_RDONLY);
+		if (e->map_fd < 0) {
+			perror(e->path);
+			return NULL;
+		}
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, e->map_fd,
+	    (off_t) e->pos * DAG_LINE_BYTES);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	if (!layout_checked) {
+		uint32_t n = chunk_lines(e, e->pos);
+		uint8_t *buf = alloc_size((size_t) n * DAG_LINE_BYTES);
+		bool same;
+
+		dagio_pread(e->dag_handle, buf, n, e->pos);
+		same = !memcmp(buf, map, (size_t) n * DAG_LINE_BYTES);
+		free(buf);
+		layout_checked = 1;
+		if (!same) {
+			fprintf(stderr, "%s: file layout is not raw DAG lines, "
+			    "disabling --mmap-verify\n", e->path);
+			mmap_verify = 0;
+			if (munmap(map, size) < 0)
+				perror("munmap");
+			return NULL;
+		}
+	}
+	if (madvise(map, size, MADV_SEQUENTIAL) < 0)
+		perror("madvise");
+	return map;
+}
+
+
+static void unmap_batch(struct epoch *e, uint8_t *map, uint32_t lines)
+{
+	size_t size = (size_t) lines * DAG_LINE_BYTES;
+	int err;
+
+	if (madvise(map, size, MADV_DONTNEED) < 0)
+		perror("madvise");
+	if (munmap(map, size) < 0)
+		perror("munmap");
+	err = posix_fadvise(e->map_fd, (off_t) e->pos * DAG_LINE_BYTES, size,
+	    POSIX_FADV_DONTNEED);
+	if (err)
+		fprintf(stderr, "posix_fadvise: %s\n", strerror(err));
+}
+
+
+static bool check_chunks(struct epoch *e)
+{
+	struct check_job *job;
+	unsigned chunks;
+	unsigned i;
+	uint32_t lines;
+	uint8_t *map = NULL;
+	uint64_t t0 = now_us();
+
+	if (!e->csum)
 		return 0;
-	e->pos += want_lines;
+
+	chunks = batch_chunks(e, e->pos, &lines);
+	assert(chunks);
+
+	job = alloc_size(sizeof(struct check_job) + chunks * sizeof(bool));
+	job->e = e;
+	job->chunks = chunks;
+	if (mmap_verify)
+		map = map_batch(e, lines);
+	if (map) {
+		job->buf = map;
+		job->loaded = 1;
+	} else {
+		job->buf = batch_buf(e, lines, &job->loaded);
+	}
+
+	pool_run(check_group, job,
+	    (chunks + csum_lanes() - 1) / csum_lanes());
+	if (map)
+		unmap_batch(e, map, lines);
+
+	for (i = 0; i != chunks; i++) {
+		if (!job->ok[i]) {
+			debug(1, "bad chunk %u of epoch %u",
+			    e->pos / LINES_PER_CHUNK, e->num);
+			/* the DAG is not usable, so hurry up */
+			e->check = check_full;
+			e->reverify = 0;
+			range_add(&e->bad, e->pos,
+			    e->pos + chunk_lines(e, e->pos));
+		}
+		e->pos += chunk_lines(e, e->pos);
+	}
+	free(job);
+	metrics_verify((uint64_t) lines * DAG_LINE_BYTES, now_us() - t0);
+	govern_io(0, (uint64_t) lines * DAG_LINE_BYTES);
+	if (e->check == check_background)
+		govern_background((uint64_t) lines * DAG_LINE_BYTES);
+	check_max = adapt(check_max, 1, batch_max(), t0);
 	return 1;
 }
 
 
+/*
+ * Fast start: check one random chunk from each of SAMPLE_CHUNKS equal parts of
+ * the DAG, plus the last (usually partial) chunk. This reads only a few MB, so
+ * we do it all at once.
+ */
+
+static void sample_chunks(struct epoch *e)
+{
+	static unsigned seed = 0;
+	uint16_t chunks = lines_to_chunks(e->lines);
+	uint8_t res[CSUM_BYTES];
+	unsigned i, from, to;
+	uint16_t chunk;
+	uint32_t pos;
+
+	if (!seed)
+		seed = now_us();
+	for (i = 0; i != IO_SLOTS; i++)
+		io_wait(&e->io[i]);
+	for (i = 0; i <= SAMPLE_CHUNKS; i++) {
+		if (i == SAMPLE_CHUNKS) {
+			chunk = chunks - 1;
+		} else {
+			from = (chunks - 1) * i / SAMPLE_CHUNKS;
+			to = (chunks - 1) * (i + 1) / SAMPLE_CHUNKS;
+			if (from == to)
+				continue;
+			chunk = from + rand_r(&seed) % (to - from);
+		}
+		pos = chunk * LINES_PER_CHUNK;
+		debug(2, "sampling chunk %u of epoch %u", chunk, e->num);
+		dagio_pread(e->dag_handle, e->chunk, chunk_lines(e, pos), pos);
+		csum_hash(res, e->chunk,
+		    (size_t) chunk_lines(e, pos) * DAG_LINE_BYTES);
+		if (memcmp(res, e->csum + (size_t) chunk * CSUM_BYTES,
+		    CSUM_BYTES)) {
+			debug(0, "epoch %u: bad sample chunk %u, verifying all",
+			    e->num, chunk);
+			e->check = check_full;
+			return;
+		}
+	}
+	debug(0, "epoch %u: sample good, verifying the rest in the background",
+	    e->num);
+	e->check = check_background;
+}
+
+
+static bool checking(const struct epoch *e)
+{
+	return e->pos < e->lines && may_check(e, e->pos);
+}
+
+
+/*
+ * We first verify what is in the file, then regenerate the chunks that failed
+ * verification, and finally generate the rest of the DAG.
+ */
+
+enum stage work_stage(const struct epoch *e)
+{
+	if (e->check == check_sample || checking(e))
+		return stage_read;
+	switch (cache_next_io(&e->cache)) {
+	case cache_io_load:
+		return stage_read;
+	case cache_io_store:
+		return stage_write;
+	default:
+		break;
+	}
+	if (e->cache.cache && e->cache.next_round == CACHE_ROUNDS)
+		return stage_write;
+	return stage_cpu;
+}
+
+
 bool work_on(struct epoch *e)
 {
-	if (!e->chunk)
-		e->chunk = alloc_size(CHUNK_BYTES);
-	assert(e->pos < e->lines);
-	debug(0, "work_on epoch %u: lines %u/%u/%u",
-	    e->num, e->pos, e->nominal, e->lines);
-	if (e->pos + LINES_PER_CHUNK > e->nominal &&
-	    e->nominal != e->lines) {
-		if (cache_build(&e->cache))
-			return 1;
-		if (!generate_chunk(e))
-			return 0;
-	} else {
-		if (!check_chunk(e)) {
+	uint32_t from;
+	uint8_t round;
+	uint64_t t0;
+
+	/* after prefetch_sync, the prefetch thread is using the same algorithm */
+	prefetch_sync(e->algo);
+	if (dag_algo != e->algo)
+		dag_algo = e->algo;
+	if (holder != e) {
+		if (holder)
+			work_release(holder);
+		assert(!e->chunk);
+		e->chunk = buf_get(chunk_buf_bytes());
+		holder = e;
+	}
+	assert(!epoch_done(e));
+	debug(0, "work_on epoch %u: lines %u/%u/%u, %u bad range(s)",
+	    e->num, e->pos, e->nominal, e->lines, range_count(e->bad));
+	if (e->check == check_sample) {
+		sample_chunks(e);
+	} else if (checking(e)) {
+		if (!check_chunks(e)) {
 			/*
-			 * @@@ Should we ftruncate the DAG file at this point ?
-			 * For now, we ignore any further content, but if we
-			 * move to interval lists, we could map chunks that are
-			 * completely backed by on-disk data.
+			 * Without checksums, we can't verify anything, so we
+			 * ignore any further content and generate it again.
 			 */
-			e->pos = e->pos - (e->pos % LINES_PER_CHUNK);
 			e->nominal = e->pos;
+		}
+	} else {
+		round = e->cache.next_round;
+		t0 = now_us();
+		if (cache_build(&e->cache)) {
+			/*
+			 * Only count single rounds we calculated here, not
+			 * loading the cache or setup steps.
+			 */
+			if (e->cache.next_round == round + 1)
+				metrics_round(now_us() - t0);
 			return 1;
 		}
+		if (e->bad) {
+			from = e->bad->from;
+			range_remove(&e->bad, from,
+			    from + generate(e, from, e->bad->to - from));
+		} else {
+			e->pos += generate(e, e->pos, e->lines - e->pos);
+		}
+		if (epoch_done(e))
+			work_drain(e);
 	}
 	if (e->nominal < e->pos)
 		e->nominal = e->pos;
@@ -138,15 +613,27 @@ bool work_on(struct epoch *e)
 }
 
 
-void dag_init(void)
+void work_drain(struct epoch *e)
 {
-	gcry_error_t err;
+	unsigned i;
 
-	gcry_check_version(NULL);
-	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
-	err = gcry_md_open(&h, GCRY_MD_SHA3_256, 0);
-	if (err) {
-		fprintf(stderr, "gcry_md_open: %s\n", gcry_strerror(err));
-		exit(1);
+	for (i = 0; i != IO_SLOTS; i++)
+		io_wait(&e->io[i]);
+	if (e->map_fd >= 0) {
+		if (close(e->map_fd) < 0)
+			perror(e->path);
+		e->map_fd = -1;
+	}
+}
+
+
+void work_release(struct epoch *e)
+{
+	work_drain(e);
+	if (e->chunk) {
+		buf_put(e->chunk, chunk_buf_bytes());
+		e->chunk = NULL;
 	}
+	if (holder == e)
+		holder = NULL;
 }
@@ -15,12 +15,46 @@
 #include "epoch.h"
 
 
+/*
+ * Verify chunks directly from memory-mapped DAG files.
+ */
+
+extern bool mmap_verify;
+
+/*
+ * Target duration of a work unit, in milliseconds. The amount of work done per
+ * call to work_on is adjusted to meet it. 0 disables the adjustment.
+ */
+
+extern unsigned latency_ms;
+
+
+/*
+ * work_stage returns the class of the next step of work on the epoch.
+ */
+
+enum stage work_stage(const struct epoch *e);
+
 /*
  * work_on returns 1 if the work done (if any) was successful, 0 if work was
  * attempted but failed.
  */
 
 bool work_on(struct epoch *e);
-void dag_init(void);
+
+/*
+ * work_drain waits until all I/O of the epoch has completed, and closes any
+ * file descriptors used for it. It must be called before closing the DAG file
+ * or freeing the chunk buffer.
+ */
+
+void work_drain(struct epoch *e);
+
+/*
+ * work_release drains the epoch's I/O and returns its chunk buffer (if any) to
+ * the buffer pool. It must be called before freeing the epoch.
+ */
+
+void work_release(struct epoch *e);
 
 #endif /* !DAGD_DAG_H */
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <sys/statvfs.h>
 
@@ -22,6 +23,15 @@
 #include "debug.h"
 #include "mqtt.h"
 #include "csum.h"
+#include "bench.h"
+#include "cache.h"
+#include "pool.h"
+#include "io.h"
+#include "prefetch.h"
+#include "dag.h"
+#include "metrics.h"
+#include "govern.h"
+#include "export.h"
 #include "epoch.h"
 
 
@@ -32,16 +42,41 @@ static void send_status(mqtt_handle mqtt, bool idle)
 	status = epoch_report();
 	mqtt_status(mqtt, status, idle);
 	free(status);
+	status = epoch_metrics();
+	mqtt_metrics(mqtt, status, idle);
+	free(status);
 	if (!idle)
 		mqtt_poll(mqtt, 0);
 }
 
 
+/*
+ * Without MQTT, we don't know whether the miner is running, and use the idle
+ * budgets.
+ */
+
+static enum govern_mode mode(void)
+{
+	return running[0] || running[1] ? govern_running : govern_idle;
+}
+
+
+static void pace(mqtt_handle mqtt)
+{
+	unsigned ms = govern_delay_ms(mode());
+
+	if (ms)
+		mqtt_wait(mqtt, ms);
+}
+
+
 static void loop(const char *broker)
 {
 	mqtt_handle mqtt = mqtt_init(broker, 0);
 	bool holding = 0;
 
+	export_init();
+
 	while (1) {
 		bool idle;
 
@@ -52,6 +87,7 @@ static void loop(const char *broker)
 		epoch_init();
 		idle = 0;
 		while (!shutdown_pending) {
+			export_update();
 			if (idle || hold) {
 				enum dag_algo last_algo;
 				int last_epoch;
@@ -59,22 +95,37 @@ static void loop(const char *broker)
 				if (!holding && hold)
 					debug(1, "holding");
 				holding = hold;
+				metrics_hold(holding);
 				last_algo = curr_algo;
 				last_epoch = curr_epoch;
-				mqtt_poll(mqtt, 1);
+				/*
+				 * While holding, we only pause work that uses
+				 * the disk. Caches are still calculated, so
+				 * that the next one is ready when the hold
+				 * ends.
+				 */
+				if (hold && !idle && epoch_work(0, stage_cpu)) {
+					send_status(mqtt, 0);
+					pace(mqtt);
+				} else {
+					mqtt_poll(mqtt, 1);
+				}
 				if (idle)
 					idle = curr_algo == (int) last_algo &&
 					    curr_epoch == last_epoch;
 			} else {
 				holding = 0;
-				idle = !epoch_work(0);
+				metrics_hold(0);
+				idle = !epoch_work(0, stage_all);
 				send_status(mqtt, idle);
+				if (!idle)
+					pace(mqtt);
 			}
 		}
 		/*
-		 * @@@ If we often have shutdowns that subsequently get
-		 * cancelled, we may try to be a bit more efficient and just
-		 * close the files but remember what we've already verified.
+		 * epoch_shutdown records in the journals how far we got, so
+		 * if the shutdown gets cancelled, epoch_init will resume
+		 * without verifying the DAGs again.
 		 */
 		epoch_shutdown();
 	}
@@ -86,11 +137,13 @@ static void once(bool use_mqtt, const char *broker, bool just_one)
 	mqtt_handle mqtt = use_mqtt ? mqtt_init(broker, 1) : NULL;
 
 	epoch_init();
-	while (!shutdown_pending && epoch_work(just_one))
+	while (!shutdown_pending && epoch_work(just_one, stage_all)) {
 		if (mqtt)
 			send_status(mqtt, 0);
+		govern_sleep(govern_idle);
+	}
 	send_status(mqtt, 1);
-	mqtt_poll(mqtt, 1);
+	mqtt_flush(mqtt);
 	epoch_shutdown();
 }
 
@@ -165,12 +218,106 @@ static off_t dag_cache_size(const char *s)
 }
 
 
+static unsigned algo_list(const char *s)
+{
+	unsigned algos = 0;
+	char *tmp, *next;
+	char *name;
+	int algo;
+
+	tmp = next = stralloc(s);
+	while ((name = strsep(&next, ","))) {
+		algo = dagalgo_code(name);
+		if (algo == -1) {
+			fprintf(stderr, "unknown algorithm \"%s\"\n", name);
+			exit(1);
+		}
+		algos |= 1 << algo;
+	}
+	free(tmp);
+	return algos;
+}
+
+
+static uint16_t get_epoch(const char *s, char **end)
+{
+	unsigned long n;
+
+	n = strtoul(s, end, 0);
+	if (n > EPOCH_MAX) {
+		fprintf(stderr, "maximum epoch supported is %u\n", EPOCH_MAX);
+		exit(1);
+	}
+	return n;
+}
+
+
+/*
+ * -g takes a comma-separated list of [algo:]epoch[-epoch]. Ranges without an
+ * algorithm apply to each algorithm selected with -a. gen_ranges returns NULL
+ * if the list is not valid.
+ */
+
+static struct gen_range *gen_ranges(const char *s, unsigned algos,
+    unsigned *n)
+{
+	struct gen_range *ranges;
+	char *tmp, *next, *item, *colon, *end;
+	unsigned items = 1;
+	unsigned these;
+	uint16_t from, to;
+	int algo;
+
+	for (item = strchr(s, ','); item; item = strchr(item + 1, ','))
+		items++;
+	ranges = alloc_size(sizeof(struct gen_range) * items * dag_algos);
+	*n = 0;
+	tmp = next = stralloc(s);
+	while ((item = strsep(&next, ","))) {
+		colon = strchr(item, ':');
+		these = algos;
+		if (colon) {
+			*colon = 0;
+			algo = dagalgo_code(item);
+			if (algo == -1) {
+				fprintf(stderr, "unknown algorithm \"%s\"\n",
+				    item);
+				exit(1);
+			}
+			these = 1 << algo;
+			item = colon + 1;
+		}
+		from = get_epoch(item, &end);
+		to = *end == '-' ? get_epoch(end + 1, &end) : from;
+		if (end == item || *end || to < from) {
+			free(ranges);
+			ranges = NULL;
+			break;
+		}
+		for (algo = 0; algo != dag_algos; algo++) {
+			if (!(these & 1 << algo))
+				continue;
+			ranges[*n].algo = algo;
+			ranges[*n].from = from;
+			ranges[*n].to = to;
+			++*n;
+		}
+	}
+	free(tmp);
+	return ranges;
+}
+
+
 static void usage(const char *name)
 {
 	fprintf(stderr,
-"usage: %s [-1 [-1]] [-a algo] [-d ...] [-e epoch] [-M] [-m host[:port]]\n"
-"       %*s[-s space|path-space] dag-fmt [csum-fmt]\n"
-"       %s -g epoch\n"
+"usage: %s [-1 [-1]] [-a algo] [-c cache-fmt] [-d ...] [-e epoch]\n"
+"       %*s[-j threads] [-M] [-m host[:port]] [-s space|path-space]\n"
+"       %*sdag-fmt [csum-fmt]\n"
+"       %s [-a algo[,algo...]] [-j threads]\n"
+"       %*s-g [algo:]epoch[-epoch][,...] [csum-fmt]\n"
+"       %s [-a algo] [-e epoch] [-j threads] [--sha3=backend] --bench\n"
+"       %*s[dag-fmt]\n"
 "\n"
 "  dag-fmt\n"
 "    Printf-style format string that expands to the paths to DAG files.\n"
@@ -187,13 +334,29 @@ static void usage(const char *name)
 "      available space, then exit.\n"
 "  -a algorithm\n"
 "      PoW algorithm, \"ethash\", \"etchash\" or \"ubqhash\". Default: ethash.\n"
+"      With -g, this can be a comma-separated list of algorithms.\n"
+"  -c cache-fmt\n"
+"      Printf-style format string that expands to the paths of files in which\n"
+"      completed Ethash caches are stored, with the same parameters as\n"
+"      dag-fmt. A stored cache is used instead of calculating it again,\n"
+"      e.g., when resuming DAG generation after a restart.\n"
 "  -d  Increase debug level (default: no debug output)\n"
 "  -e epoch\n"
 "      Begin preparing DAGs starting at the indicated epoch (default: start\n"
 "      with the first epoch in the cache or, if there is none, wait until an\n"
 "      epoch is announced over MQTT)\n"
-"  -g epoch\n"
-"      generate the checksums for the specified epoch (on standard output)\n"
+"  -g [algo:]epoch[-epoch][,...]\n"
+"      generate the checksums for the specified epochs or ranges of epochs\n"
+"      (inclusive). A range prefixed with an algorithm is only for this\n"
+"      algorithm, e.g., ethash:0-480,etchash:190-440. Otherwise, it is for\n"
+"      each algorithm selected with -a. If csum-fmt is given, checksums are\n"
+"      written to the files it expands to. Otherwise, only a single epoch of\n"
+"      a single algorithm can be generated, and the checksums are written to\n"
+"      standard output.\n"
+"  -j threads\n"
+"      Number of threads used for calculating DAG lines and for verifying\n"
+"      chunks (up to this number of chunks are verified concurrently).\n"
+"      Default: 1\n"
 "  -M  if using one-shot mode (options -1 or -1 -1), still announce progress\n"
 "      on MQTT.\n"
 "  -m host[:port]\n"
@@ -206,10 +369,69 @@ static void usage(const char *name)
 "  -s path-space\n"
 "      The available DAG space is the size of the file system at \"path\",\n"
 "      minus the specified space.\n"
+"  --async-io\n"
+"      Read and write DAG files in a separate thread, overlapping I/O with\n"
+"      DAG calculation and checksum verification.\n"
+"  --bench\n"
+"      Measure the speed of cache calculation, DAG line calculation with\n"
+"      different batch sizes and thread counts, checksum hashing, and, if\n"
+"      dag-fmt is given, DAG file I/O (on a temporary file next to the DAG of\n"
+"      the epoch set with -e, default 0), and print the results as CSV.\n"
+"  --csum-format=version\n"
+"      Checksum file format written by -g: 1 for just the checksums, 2 to add\n"
+"      a header describing them and a Merkle root covering all of them.\n"
+"      Both formats are accepted when verifying DAGs. Default: 1\n"
+"  --cpu-limit=percent[/percent]\n"
+"      Limit DAG and checksum calculation to the given percentage of one CPU\n"
+"      core, on average. The second value, if given, applies while the miner\n"
+"      is idle or if its state is unknown (one-shot operation without MQTT,\n"
+"      and -g). This includes the --prefetch thread. 0 means no limit.\n"
+"      Default: 0\n"
 "  --etchash=activation_epoch\n"
 "      Set up ETChash (ECIP-1099) activation epoch. By default, the epoch\n"
 "      390 is used for the algorithm change.\n"
-    , name, (int) strlen(name) + 1, "", name);
+"  --export=socket\n"
+"      Hand out complete and verified DAGs as sealed shared memory (memfd)\n"
+"      to clients connecting to the Unix socket at the given path (see\n"
+"      export.h and dagfetch). Not available in one-shot operation.\n"
+"  --fast-start[=MBps]\n"
+"      When finding a complete DAG at startup, first only verify a random\n"
+"      sample of its chunks. If they are good, report the DAG as usable and\n"
+"      verify the rest in the background, reading at most MBps MB/s\n"
+"      (default: 20), and only if there is no other work to do. A bad chunk\n"
+"      found later makes the DAG unusable until it has been repaired.\n"
+"  --latency=ms\n"
+"      Adjust the number of DAG lines generated or verified at a time such\n"
+"      that each step takes about the specified time, in milliseconds. 0\n"
+"      uses fixed sizes (one chunk, or one chunk per thread and hash lane).\n"
+"      Default: 200\n"
+"  --lookahead=N\n"
+"      While the DAG of the current epoch is incomplete, also prepare the\n"
+"      DAGs of up to N (at most %u) following epochs, with a smaller share\n"
+"      of the work, if there is enough space for them. Default: 0\n"
+"  --mmap-verify\n"
+"      Verify DAG files by hashing directly from memory-mapped files instead\n"
+"      of reading them into a buffer, and drop the pages from the page cache\n"
+"      when done.\n"
+"  --prefetch\n"
+"      Calculate the cache of the epoch following the current one in a\n"
+"      low-priority thread, so that its DAG can be generated right away.\n"
+"  --read-limit=MBps[/MBps]\n"
+"      Limit reading DAG files for verification to the given rate, in MB/s.\n"
+"      The second value is for when the miner is idle, like --cpu-limit.\n"
+"  --sha3=backend\n"
+"      SHA3-256 implementation for checksums: \"scalar\", \"sse2\" or \"avx2\"\n"
+"      (x86), \"neon\" (ARM), or \"gcrypt\" for libgcrypt. Default: the\n"
+"      fastest built-in one supported by the CPU.\n"
+"  --verify-all\n"
+"      Verify DAGs again that the journals (dag-file.journal) record as\n"
+"      completely verified. The DAGs stay usable while this is done in the\n"
+"      background, like with --fast-start, unless a bad chunk is found.\n"
+"  --write-limit=MBps[/MBps]\n"
+"      Limit writing DAG files to the given rate, in MB/s, like --read-limit.\n"
+    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "", name,
+    (int) strlen(name) + 1, "", name, (int) strlen(name) + 1, "",
+    LOOKAHEAD_MAX);
 	exit(1);
 }
 
@@ -219,19 +441,40 @@ int main(int argc, char **argv)
 	bool one_shot = 0;
 	bool just_one = 0;
 	const char *broker = NULL;
-	bool generate = 0;
+	const char *generate = NULL;
+	struct gen_range *ranges;
+	unsigned n_ranges;
+	bool benchmark = 0;
+	unsigned algos = 1 << da_ethash;
 	bool status_on_mqtt = 0;
+	unsigned threads = 1;
+	bool async_io = 0;
+	const char *sha3 = NULL;
 	char *end;
 	int c;
 
 	int longopt = 0;
 	const struct option longopts[] = {
 		{ "alt-epoch",	1,	&longopt,	'E' },
+		{ "async-io",	0,	&longopt,	'a' },
+		{ "bench",	0,	&longopt,	'b' },
+		{ "cpu-limit",	1,	&longopt,	'C' },
+		{ "csum-format", 1,	&longopt,	'c' },
 		{ "etchash",	1,	&longopt,	'e' },
+		{ "export",	1,	&longopt,	'x' },
+		{ "fast-start",	2,	&longopt,	'f' },
+		{ "latency",	1,	&longopt,	'l' },
+		{ "lookahead",	1,	&longopt,	'L' },
+		{ "mmap-verify", 0,	&longopt,	'm' },
+		{ "prefetch",	0,	&longopt,	'p' },
+		{ "read-limit",	1,	&longopt,	'r' },
+		{ "sha3",	1,	&longopt,	's' },
+		{ "verify-all",	0,	&longopt,	'v' },
+		{ "write-limit", 1,	&longopt,	'w' },
 		{ NULL,		0,	NULL,		0 }
 	};
 
-	while ((c = getopt_long(argc, argv, "1a:de:g:Mm:s:", longopts, NULL))
+	while ((c = getopt_long(argc, argv, "1a:c:de:g:j:Mm:s:", longopts, NULL))
 	    != EOF)
 		switch (c) {
 		case '1':
@@ -239,29 +482,29 @@ int main(int argc, char **argv)
 			one_shot = 1;
 			break;
 		case 'a':
-			curr_algo = dagalgo_code(optarg);
-			if (curr_algo == -1) {
-				fprintf(stderr, "unknown algorithm \"%s\"\n",
-				    optarg);
-				exit(1);
-			}
+			algos = algo_list(optarg);
+			curr_algo = ffs(algos) - 1;
+			break;
+		case 'c':
+			if (!template_valid(optarg))
+				usage(*argv);
+			cache_path_template = optarg;
 			break;
 		case 'd':
 			debug_level++;
 			break;
 		case 'g':
-			generate = 1;
-			/* fall through */
+			generate = optarg;
+			break;
 		case 'e':
-			curr_epoch = strtoul(optarg, &end, 0);
+			curr_epoch = get_epoch(optarg, &end);
 			if (*end)
 				usage(*argv);
-			if (curr_epoch > EPOCH_MAX) {
-				fprintf(stderr,
-				    "maximum epoch supported is %u\n",
-				    EPOCH_MAX);
-				exit(1);
-			}
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 0);
+			if (*end || !threads)
+				usage(*argv);
 			break;
 		case 'M':
 			status_on_mqtt = 1;
@@ -274,6 +517,24 @@ int main(int argc, char **argv)
 			break;
 		case 0:
 			switch (longopt) {
+			case 'a':
+				async_io = 1;
+				break;
+			case 'b':
+				benchmark = 1;
+				break;
+			case 'C':
+				if (!govern_parse(
+				    &budget[govern_running].cpu_pct,
+				    &budget[govern_idle].cpu_pct, optarg))
+					usage(*argv);
+				break;
+			case 'c':
+				csum_version = strtoul(optarg, &end, 0);
+				if (*end || csum_version < 1 ||
+				    csum_version > 2)
+					usage(*argv);
+				break;
 			case 'E':
 				alt_epoch = strtoul(optarg, &end, 0);
 				if (*end)
@@ -284,6 +545,51 @@ int main(int argc, char **argv)
 				if (*end)
 					usage(*argv);
 				break;
+			case 'f':
+				fast_start = 1;
+				if (!optarg)
+					break;
+				background_mb_s = strtoul(optarg, &end, 0);
+				if (*end)
+					usage(*argv);
+				break;
+			case 'l':
+				latency_ms = strtoul(optarg, &end, 0);
+				if (*end)
+					usage(*argv);
+				break;
+			case 'L':
+				lookahead = strtoul(optarg, &end, 0);
+				if (*end || lookahead > LOOKAHEAD_MAX)
+					usage(*argv);
+				break;
+			case 'm':
+				mmap_verify = 1;
+				break;
+			case 'p':
+				prefetch_enabled = 1;
+				break;
+			case 'r':
+				if (!govern_parse(
+				    &budget[govern_running].read_mb_s,
+				    &budget[govern_idle].read_mb_s, optarg))
+					usage(*argv);
+				break;
+			case 's':
+				sha3 = optarg;
+				break;
+			case 'v':
+				verify_all = 1;
+				break;
+			case 'w':
+				if (!govern_parse(
+				    &budget[govern_running].write_mb_s,
+				    &budget[govern_idle].write_mb_s, optarg))
+					usage(*argv);
+				break;
+			case 'x':
+				export_path = optarg;
+				break;
 			default:
 				abort();
 			}
@@ -292,15 +598,43 @@ int main(int argc, char **argv)
 			usage(*argv);
 		}
 
+	csum_init(sha3);
+	pool_init(threads);
+	io_init(async_io);
+
 	if (generate) {
+		ranges = gen_ranges(generate, algos, &n_ranges);
+		if (!ranges)
+			usage(*argv);
 		switch (argc - optind) {
 		case 0:
-			csum_generate(curr_algo, curr_epoch);
+			if (n_ranges != 1 || ranges->from != ranges->to)
+				usage(*argv);
+			csum_generate(ranges, n_ranges, NULL);
+			free(ranges);
+			return 0;
+		case 1:
+			if (!template_valid(argv[optind]))
+				usage(*argv);
+			csum_generate(ranges, n_ranges, argv[optind]);
+			free(ranges);
 			return 0;
 		default:
 			usage(*argv);
 		}
 	}
+	if (algos & (algos - 1))
+		usage(*argv);
+
+	if (benchmark) {
+		if (argc - optind > 1)
+			usage(*argv);
+		if (argc != optind && !template_valid(argv[optind]))
+			usage(*argv);
+		bench(ffs(algos) - 1, curr_epoch == -1 ? 0 : curr_epoch,
+		    argc == optind ? NULL : argv[optind]);
+		return 0;
+	}
 
 	switch (argc - optind) {
 	case 2:
@@ -0,0 +1,245 @@
+/*
+ * dagfetch.c - Get a DAG from dagd in shared memory and check it
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for F_GET_SEALS */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <gcrypt.h>
+
+#include "linzhi/dag.h"
+
+#include "csum.h"
+#include "export.h"
+
+
+#define	SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+
+/* ----- Request the DAG --------------------------------------------------- */
+
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int s;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	return s;
+}
+
+
+/*
+ * Returns the memfd and sets *bytes to the size of the DAG.
+ */
+
+static int fetch(const char *path, const char *algo, const char *epoch,
+    uint64_t *bytes)
+{
+	char buf[EXPORT_MSG_MAX];
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= sizeof(buf) - 1,
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control.buf,
+		.msg_controllen	= sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t got;
+	char *end;
+	int s, fd = -1;
+
+	s = connect_to(path);
+	if (dprintf(s, "%s %s\n", algo, epoch) < 0) {
+		perror(path);
+		exit(1);
+	}
+	got = recvmsg(s, &mh, MSG_CMSG_CLOEXEC);
+	if (got < 0) {
+		perror(path);
+		exit(1);
+	}
+	close(s);
+	buf[got] = 0;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	*bytes = strtoull(buf, &end, 10);
+	if (end == buf || *end != '\n' || fd < 0) {
+		fprintf(stderr, "%s", got ? buf : "no reply\n");
+		exit(1);
+	}
+	return fd;
+}
+
+
+/* ----- Check the DAG ----------------------------------------------------- */
+
+
+/*
+ * The checksums are at the end of the checksum file, after the header if
+ * there is one.
+ */
+
+static uint8_t *load_csums(const char *path, unsigned chunks)
+{
+	size_t need = (size_t) chunks * CSUM_BYTES;
+	struct stat st;
+	uint8_t *buf;
+	ssize_t got;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((size_t) st.st_size < need) {
+		fprintf(stderr, "%s: too short for %u chunks\n", path, chunks);
+		exit(1);
+	}
+	buf = malloc(need);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	got = pread(fd, buf, need, st.st_size - need);
+	if (got != (ssize_t) need) {
+		if (got < 0)
+			perror(path);
+		else
+			fprintf(stderr, "%s: short read\n", path);
+		exit(1);
+	}
+	close(fd);
+	return buf;
+}
+
+
+static unsigned check(const uint8_t *dag, uint64_t bytes,
+    const uint8_t *csums, unsigned chunks)
+{
+	uint8_t digest[32];	/* SHA3-256 */
+	unsigned bad = 0;
+	unsigned i;
+	uint64_t len;
+
+	for (i = 0; i != chunks; i++) {
+		len = bytes - (uint64_t) i * CHUNK_BYTES;
+		if (len > CHUNK_BYTES)
+			len = CHUNK_BYTES;
+		gcry_md_hash_buffer(GCRY_MD_SHA3_256, digest,
+		    dag + (size_t) i * CHUNK_BYTES, len);
+		if (memcmp(digest, csums + (size_t) i * CSUM_BYTES,
+		    CSUM_BYTES)) {
+			fprintf(stderr, "bad chunk %u\n", i);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s socket algo epoch csum-file\n\n"
+"  Get the DAG of the specified algorithm and epoch from dagd --export=socket\n"
+"  and check it against the checksum file.\n"
+    , name);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	uint64_t bytes;
+	uint8_t *dag, *csums;
+	unsigned chunks, bad;
+	struct stat st;
+	int fd, seals;
+
+	if (argc != 5)
+		usage(*argv);
+	if (!gcry_check_version(NULL)) {
+		fprintf(stderr, "gcry_check_version failed\n");
+		return 1;
+	}
+
+	fd = fetch(argv[1], argv[2], argv[3], &bytes);
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0) {
+		perror("F_GET_SEALS");
+		return 1;
+	}
+	if ((seals & SEALS) != SEALS) {
+		fprintf(stderr, "memfd is not sealed (0x%x)\n", seals);
+		return 1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return 1;
+	}
+	if ((uint64_t) st.st_size < bytes || bytes % DAG_LINE_BYTES) {
+		fprintf(stderr, "bad size %llu for %llu bytes\n",
+		    (unsigned long long) st.st_size,
+		    (unsigned long long) bytes);
+		return 1;
+	}
+	dag = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+	if (dag == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	chunks = (bytes + CHUNK_BYTES - 1) / CHUNK_BYTES;
+	csums = load_csums(argv[4], chunks);
+	bad = check(dag, bytes, csums, chunks);
+	printf("%s %s: %llu bytes, %u/%u chunks good\n", argv[2], argv[3],
+	    (unsigned long long) bytes, chunks - bad, chunks);
+	return !!bad;
+}
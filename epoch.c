@@ -7,7 +7,7 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
-#define _GNU_SOURCE	/* for asprintf */
+#define _GNU_SOURCE	/* for asprintf, fallocate */
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,6 +15,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -30,17 +33,38 @@
 #include "debug.h"
 #include "mqtt.h"
 #include "cache.h"
+#include "prefetch.h"
+#include "csum.h"
 #include "dag.h"
+#include "journal.h"
+#include "metrics.h"
+#include "govern.h"
 #include "epoch.h"
 
 
-struct epoch *epochs = NULL;
 const char *dag_path_template;
 const char *csum_path_template;
 off_t max_cache;
+unsigned lookahead = 0;
+bool fast_start = 0;
+bool verify_all = 0;
 
 static off_t block_size;
 
+/*
+ * The epochs of each algorithm are in a doubly-linked list, sorted by epoch
+ * number, and can also be found directly by number through epoch_index.
+ * cache_sum is the sum of the sizes of all epochs.
+ */
+
+static struct epoch_list {
+	struct epoch	*first;
+	struct epoch	*last;
+} epochs[dag_algos];
+
+static struct epoch *epoch_index[dag_algos][EPOCH_MAX + 1];
+static off_t cache_sum;	/* cache size in bytes, rounded to blocks */
+
 
 /* ----- Helper functions -------------------------------------------------- */
 
@@ -53,6 +77,27 @@ static off_t round_to_block(off_t size, blksize_t blksize)
 }
 
 
+/*
+ * Disk space used by the DAG file. Preallocated space counts, even if the file
+ * does not extend over it yet. If the file system reports less space than the
+ * file size rounded to blocks (e.g., because it has not allocated recent
+ * writes yet), or if we can't stat the file, we use the latter.
+ */
+
+static off_t disk_size(const struct epoch *e, uint64_t bytes)
+{
+	off_t size = round_to_block(bytes, block_size);
+	struct stat st;
+
+	if (stat(e->path, &st) < 0) {
+		perror(e->path);
+		return size;
+	}
+	return (off_t) st.st_blocks * 512 > size ?
+	    (off_t) st.st_blocks * 512 : size;
+}
+
+
 static off_t get_block_size(void)
 {
 	char *path = ".";
@@ -116,6 +161,7 @@ bool template_valid(const char *s)
 static struct epoch *epoch_new(enum dag_algo algo, uint16_t n)
 {
 	struct epoch *e = alloc_type(struct epoch);
+	unsigned i;
 
 	e->path = template_epoch(dag_path_template, algo, n);
 
@@ -124,9 +170,12 @@ static struct epoch *epoch_new(enum dag_algo algo, uint16_t n)
 	e->algo = algo;
 	e->num = n;
 	e->dag_handle = NULL;
-	e->csum_fd = -1;
+	e->csum = NULL;
 
 	e->pos = 0;
+	e->check = check_full;
+	e->reverify = 0;
+	e->bad = NULL;
 	e->nominal = 0;
 	e->lines = get_full_lines(n);
 	e->size = 0;
@@ -138,9 +187,14 @@ static struct epoch *epoch_new(enum dag_algo algo, uint16_t n)
 	    (unsigned long long) e->final * DAG_LINE_BYTES);
 
 	cache_init(&e->cache, e->algo, e->num);
+	prefetch_take(&e->cache);
 	e->chunk = NULL;
+	for (i = 0; i != IO_SLOTS; i++)
+		io_req_init(&e->io[i]);
+	e->slot = 0;
+	e->map_fd = -1;
 
-	e->next = NULL;
+	e->prev = e->next = NULL;
 
 	return e;
 }
@@ -150,16 +204,13 @@ static void open_csum(struct epoch *e)
 {
 	char *path;
 
-	if (!csum_path_template) {
-		e->csum_fd = -1;
+	e->csum = NULL;
+	if (!csum_path_template)
 		return;
-	}
 
 	path = template_epoch(csum_path_template, e->algo, e->num);
 	debug(1, "%s", path);
-	e->csum_fd = open(path, O_RDONLY);
-	if (e->csum_fd < 0)
-		perror(path);
+	e->csum = csum_load(path, e->algo, e->num, e->lines);
 	free(path);
 }
 
@@ -176,12 +227,21 @@ static struct epoch *epoch_open(enum dag_algo algo, uint16_t n)
 
 	bytes = dagio_bytes(e->dag_handle);
 	e->nominal = bytes / DAG_LINE_BYTES;
-	e->size = round_to_block(bytes, block_size);
+	e->size = disk_size(e, bytes);
 
 	debug(1, "%llu bytes = %u lines",
 	    (unsigned long long) bytes, e->nominal);
 
+	journal_load(e);
 	open_csum(e);
+	if (fast_start && e->csum && e->nominal == e->lines &&
+	    e->pos != e->lines)
+		e->check = check_sample;
+	if (verify_all && e->csum && e->pos == e->lines && !e->bad) {
+		e->pos = 0;
+		e->check = check_background;
+		e->reverify = 1;
+	}
 
 	return e;
 
@@ -195,128 +255,416 @@ fail:
 /* ----- Epoch addition/removal/reset -------------------------------------- */
 
 
-static void append_epoch(struct epoch *e)
+static void link_epoch(struct epoch *e)
 {
-	struct epoch **anchor = &epochs;
+	struct epoch_list *list = &epochs[e->algo];
+	struct epoch *prev;
+
+	assert(e->num <= EPOCH_MAX && !epoch_index[e->algo][e->num]);
+
+	/* new epochs usually go to the end of the list */
+	prev = list->last;
+	while (prev && prev->num > e->num)
+		prev = prev->prev;
+	e->prev = prev;
+	e->next = prev ? prev->next : list->first;
+	if (e->next)
+		e->next->prev = e;
+	else
+		list->last = e;
+	if (prev)
+		prev->next = e;
+	else
+		list->first = e;
+	epoch_index[e->algo][e->num] = e;
+	cache_sum += e->size;
+}
 
-	for (anchor = &epochs; *anchor; anchor = &(*anchor)->next)
-		if ((*anchor)->num > e->num)
-			break;
-	e->next = *anchor;
-	*anchor = e;
+
+static void unlink_epoch(struct epoch *e)
+{
+	struct epoch_list *list = &epochs[e->algo];
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		list->first = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		list->last = e->prev;
+	e->prev = e->next = NULL;
+	epoch_index[e->algo][e->num] = NULL;
+	cache_sum -= e->size;
+}
+
+
+static void set_size(struct epoch *e, off_t size)
+{
+	cache_sum += size - e->size;
+	e->size = size;
+}
+
+
+/*
+ * Space the DAG still needs to grow to its final size. The space used can
+ * exceed e->final a little, due to file system metadata.
+ */
+
+static off_t missing(const struct epoch *e)
+{
+	return e->final > e->size ? e->final - e->size : 0;
+}
+
+
+static struct epoch *find_epoch(enum dag_algo algo, unsigned n)
+{
+	return n <= EPOCH_MAX ? epoch_index[algo][n] : NULL;
+}
+
+
+/*
+ * The first epoch, i.e., the one with the lowest number, of all algorithms.
+ */
+
+static struct epoch *first_epoch(void)
+{
+	struct epoch *first = NULL;
+	enum dag_algo algo;
+
+	for (algo = 0; algo != dag_algos; algo++)
+		if (epochs[algo].first &&
+		    (!first || epochs[algo].first->num < first->num))
+			first = epochs[algo].first;
+	return first;
 }
 
 
 static void free_epoch(struct epoch *e)
 {
 	debug(1, "free_epoch %u (%p)", e->num, e);
-	if (e->dag_handle)
+	work_release(e);
+	if (e->dag_handle) {
+		journal_store(e);
 		dagio_close(e->dag_handle);
-	if (e->csum_fd >= 0 && close(e->csum_fd) < 0)
-		perror("close checksum");
+	}
+	free(e->csum);
 	free(e->path);
+	range_free(&e->bad);
 	cache_free(&e->cache);
-	if (e->chunk)
-		free(e->chunk);
 	free(e);
 }
 
 
 static void wipe_epoch(struct epoch *e)
 {
+	work_drain(e);
 	dagio_close_and_delete(e->dag_handle);
+	journal_remove(e);
+	cache_remove(&e->cache);
 	e->dag_handle = NULL;
 }
 
 
-static void remove_epoch(struct epoch *e, off_t *sum)
+static void remove_epoch(struct epoch *e)
 {
-	struct epoch *prev = NULL;
-	unsigned long long old_size = *sum;
-
-	assert(epochs);
-
-	*sum = 0;
-	for (prev = epochs; prev && prev->next != e; prev = prev->next)
-		*sum += prev->size;
-
 	debug(1, "remove_epoch %s %u: %llu/%llu bytes",
 	    dagalgo_name(e->algo), e->num, (unsigned long long) e->size,
-	    old_size);
-
-	if (prev)
-		prev->next = e->next;
-	else
-		epochs = e->next;
+	    (unsigned long long) cache_sum);
 
+	unlink_epoch(e);
 	wipe_epoch(e);
 	free_epoch(e);
+}
 
-	while (prev) {
-		*sum += prev->size;
-		prev = prev->next;
-	}
+
+/*
+ * The epoch to remove first when we need room for "algo": the first epoch of
+ * any other algorithm or, if there is none, the last epoch of "algo".
+ */
+
+static struct epoch *pick_victim(enum dag_algo algo)
+{
+	struct epoch *victim = NULL;
+	enum dag_algo a;
+
+	for (a = 0; a != dag_algos; a++)
+		if (a != algo && epochs[a].first &&
+		    (!victim || epochs[a].first->num < victim->num))
+			victim = epochs[a].first;
+	return victim ? victim : epochs[algo].last;
 }
 
 
 /* ----- Report ------------------------------------------------------------ */
 
 
-#define	REPORT_ENTRY_MAX_BYTES	(16 + (8 + 1) * 6 + 1)
+bool epoch_done(const struct epoch *e)
+{
+	return e->pos == e->lines && !e->bad;
+}
+
+
+const char *epoch_complete(enum dag_algo algo, unsigned n, uint32_t *lines)
+{
+	const struct epoch *e = find_epoch(algo, n);
+
+	if (!e || !e->dag_handle || !epoch_done(e))
+		return NULL;
+	*lines = e->lines;
+	return e->path;
+}
+
+
+/*
+ * Number of lines at the beginning of the DAG that are known to be good. If
+ * the sample was good, we consider the whole DAG good until we find a bad
+ * chunk.
+ */
+
+static uint32_t epoch_valid(const struct epoch *e)
+{
+	if (e->bad)
+		return e->bad->from;
+	return e->check == check_background ? e->lines : e->pos;
+}
+
+
+static const char *epoch_phase(const struct epoch *e)
+{
+	if (e->check == check_sample)
+		return "sample";
+	if (epoch_done(e))
+		return "done";
+	switch (work_stage(e)) {
+	case stage_read:
+		return e->check == check_background ? "background" : "verify";
+	case stage_cpu:
+		return "cache";
+	default:
+		return "generate";
+	}
+}
+
+
+/* the phase adds a comma and up to 10 characters ("background") */
+#define	REPORT_ENTRY_MAX_BYTES	(16 + (8 + 1) * 6 + 1 + 1 + 10)
 
 
 char *epoch_report(void)
 {
 	unsigned n = 0;
+	enum dag_algo algo;
 	struct epoch *e;
 	char *buf, *s;
 	int len;
 
-	for (e = epochs; e; e = e->next)
-		n++;
+	for (algo = 0; algo != dag_algos; algo++)
+		for (e = epochs[algo].first; e; e = e->next)
+			n++;
 	buf = s = alloc_size(n * REPORT_ENTRY_MAX_BYTES + 1);
-	for (e = epochs; e; e = e->next) {
-		if (s != buf)
-			*s++ = ';';
-
-		len = sprintf(s, "%s,%u,%u,%u,%u,%u,%u",
-		    dagalgo_name(e->algo), e->num, e->pos, e->nominal,
-		    e->lines, e->cache.next_round, CACHE_ROUNDS);
-		s += len;
-		assert(buf + n * REPORT_ENTRY_MAX_BYTES + 1 > s);
-	}
+	for (algo = 0; algo != dag_algos; algo++)
+		for (e = epochs[algo].first; e; e = e->next) {
+			if (s != buf)
+				*s++ = ';';
+
+			len = sprintf(s, "%s,%u,%u,%u,%u,%u,%u,%s",
+			    dagalgo_name(e->algo), e->num, epoch_valid(e),
+			    e->nominal, e->lines, e->cache.next_round,
+			    CACHE_ROUNDS, epoch_phase(e));
+			s += len;
+			assert(buf + n * REPORT_ENTRY_MAX_BYTES + 1 > s);
+		}
 	*s = 0;
 	return buf;
 }
 
 
+#define	ETA_ENTRY_MAX_BYTES	(16 + 1 + 5 + 1 + 11 + 1)
+
+
+char *epoch_metrics(void)
+{
+	unsigned n = 0;
+	enum dag_algo algo;
+	struct epoch *e;
+	const char *sep = " eta=";
+	char *buf, *s;
+
+	for (algo = 0; algo != dag_algos; algo++)
+		for (e = epochs[algo].first; e; e = e->next)
+			n++;
+	buf = s = alloc_size(METRICS_MAX_BYTES + 5 +
+	    n * ETA_ENTRY_MAX_BYTES + 1);
+	metrics_format(s);
+	s += strlen(s);
+	for (algo = 0; algo != dag_algos; algo++)
+		for (e = epochs[algo].first; e; e = e->next) {
+			if (epoch_done(e))
+				continue;
+			s += sprintf(s, "%s%s:%u:%d", sep,
+			    dagalgo_name(e->algo), e->num, metrics_eta(e));
+			sep = ",";
+		}
+	return buf;
+}
+
+
 /* ----- Scan cache for DAGs ----------------------------------------------- */
 
 
-static void epoch_scan(void)
+static bool scan_epoch(uint16_t epoch)
+{
+	/* @@@ hack: include epoch 0 for ZIL */
+	return !epoch || (epoch >= EPOCH_MIN && epoch <= EPOCH_MAX);
+}
+
+
+static void scan_open(enum dag_algo algo, uint16_t epoch)
 {
 	struct epoch *e;
+
+	debug(1, "epoch_scan: %s (%u) %u", dagalgo_name(algo), algo, epoch);
+	e = epoch_open(algo, epoch);
+	if (e)
+		link_epoch(e);
+}
+
+
+/*
+ * Try every algorithm and epoch. We use this if we can't list the files, e.g.,
+ * because the directory depends on the algorithm or epoch.
+ */
+
+static void scan_all(void)
+{
 	enum dag_algo algo;
 	uint16_t epoch;
 
-	/* @@@ hack: include epoch 0 for ZIL */
 	for (algo = 0; algo != dag_algos; algo++)
 		for (epoch = 0; epoch <= EPOCH_MAX;
-		    epoch = epoch < EPOCH_MIN ? EPOCH_MIN : epoch + 1) {
-			debug(1, "epoch_scan: %s (%u) %u",
-			    dagalgo_name(algo), algo, epoch);
-			e = epoch_open(algo, epoch);
-			if (!e)
+		    epoch = epoch < EPOCH_MIN ? EPOCH_MIN : epoch + 1)
+			scan_open(algo, epoch);
+}
+
+
+/*
+ * Match a file name against the file name part of the template, with the
+ * algorithm "algo". On success, returns 1 and sets *epoch. A template without
+ * %u never matches. The template may contain flags and field widths, e.g.,
+ * %03u, which we skip. The caller has to check that the template indeed
+ * expands to the file name.
+ */
+
+static bool match_name(const char *fmt, const char *name, enum dag_algo algo,
+    unsigned long *epoch)
+{
+	const char *algo_name = dagalgo_name(algo);
+	bool have_epoch = 0;
+	char *end;
+
+	while (*fmt) {
+		if (*fmt != '%' || fmt[1] == '%') {
+			if (*name != *fmt)
+				return 0;
+			fmt += *fmt == '%' ? 2 : 1;
+			name++;
+			continue;
+		}
+		fmt++;
+		while (*fmt && !isalpha((unsigned char) *fmt))
+			fmt++;
+		switch (*fmt++) {
+		case 's':
+			if (strncmp(name, algo_name, strlen(algo_name)))
+				return 0;
+			name += strlen(algo_name);
+			break;
+		case 'u':
+			if (!isdigit((unsigned char) *name))
+				return 0;
+			*epoch = strtoul(name, &end, 10);
+			name = end;
+			have_epoch = 1;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return !*name && have_epoch;
+}
+
+
+/*
+ * List the directory of the DAG files and only open the files whose name the
+ * template expands to. We collect the epochs first, so that they get opened
+ * in the same order as by scan_all.
+ */
+
+static bool scan_dir(void)
+{
+	bool found[dag_algos][EPOCH_MAX + 1];
+	const char *slash = strrchr(dag_path_template, '/');
+	const char *fmt = slash ? slash + 1 : dag_path_template;
+	char *dir;
+	DIR *d;
+	const struct dirent *de;
+	enum dag_algo algo;
+	unsigned long epoch = 0;
+	char *path;
+
+	if (slash) {
+		dir = stralloc(dag_path_template);
+		dir[slash == dag_path_template ? 1 : slash - dag_path_template] =
+		    0;
+	} else {
+		dir = stralloc(".");
+	}
+	if (strchr(dir, '%')) {
+		free(dir);
+		return 0;
+	}
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		free(dir);
+		return 0;
+	}
+
+	memset(found, 0, sizeof(found));
+	while ((de = readdir(d)))
+		for (algo = 0; algo != dag_algos; algo++) {
+			if (!match_name(fmt, de->d_name, algo, &epoch) ||
+			    epoch > EPOCH_MAX || !scan_epoch(epoch))
 				continue;
-			append_epoch(e);
+			path = template_epoch(dag_path_template, algo, epoch);
+			if (!strcmp(path + (fmt - dag_path_template),
+			    de->d_name))
+				found[algo][epoch] = 1;
+			free(path);
 		}
+	closedir(d);
+	free(dir);
+
+	for (algo = 0; algo != dag_algos; algo++)
+		for (epoch = 0; epoch <= EPOCH_MAX; epoch++)
+			if (found[algo][epoch])
+				scan_open(algo, epoch);
+	return 1;
+}
+
+
+static void epoch_scan(void)
+{
+	if (!scan_dir())
+		scan_all();
 }
 
 
 /* ----- Work on the DAG cache --------------------------------------------- */
 
 
-static bool may_add(enum dag_algo algo, uint16_t n, off_t sum)
+static bool may_add(enum dag_algo algo, uint16_t n)
 {
 	struct epoch *victim;
 	off_t size =
@@ -325,30 +673,58 @@ static bool may_add(enum dag_algo algo, uint16_t n, off_t sum)
 
 	debug(1, "consider adding epoch %s %u (size %llu, cache %llu/%llu",
 	    dagalgo_name(algo), n, (unsigned long long) size,
-	    (unsigned long long) sum, (unsigned long long) max_cache);
-	while (sum >= max_cache || sum + size >= max_cache) {
-		if (!epochs)
+	    (unsigned long long) cache_sum, (unsigned long long) max_cache);
+	while (cache_sum >= max_cache || cache_sum + size >= max_cache) {
+		victim = pick_victim(algo);
+		if (!victim)
 			return 0;
-		for (victim = epochs; victim->next; victim = victim->next)
-			if (victim->algo != algo)
-				break;
 		if (victim->algo == algo && victim->num <= n)
 			return 0;
 		debug(1, "remove epoch %u (make room)", victim->num);
-		remove_epoch(victim, &sum);
+		remove_epoch(victim);
 	}
 	return 1;
 }
 
 
+/*
+ * We reserve the space for the whole DAG when creating the file, so that it
+ * isn't fragmented by growing a bit at a time. The file size still only
+ * covers the lines written so far.
+ */
+
+static void preallocate(const struct epoch *e)
+{
+	int fd;
+
+	fd = open(e->path, O_WRONLY);
+	if (fd < 0) {
+		perror(e->path);
+		return;
+	}
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, e->final) < 0) {
+		if (errno == EOPNOTSUPP)
+			debug(1, "%s: no preallocation", e->path);
+		else
+			perror(e->path);
+	}
+	if (close(fd) < 0)
+		perror(e->path);
+}
+
+
 static bool create_dag(struct epoch *e)
 {
 	assert(!e->dag_handle);
+	journal_remove(e);
 	e->dag_handle = dagio_try_open(e->path, O_CREAT | O_RDWR | O_TRUNC,
 	    e->lines);
-	if (!e->dag_handle)
+	if (!e->dag_handle) {
 		perror(e->path);
-	return e->dag_handle;
+		return 0;
+	}
+	preallocate(e);
+	return 1;
 }
 
 
@@ -360,60 +736,163 @@ static void new_epoch(enum dag_algo algo, uint16_t n)
 		free_epoch(e);
 		return;
 	}
+	e->size = disk_size(e, 0);
 	open_csum(e);
-	append_epoch(e);
+	link_epoch(e);
 }
 
 
 static bool maybe_prepend(void)
 {
-	struct epoch *e;
+	struct epoch *e = epochs[curr_algo].first;
 
-	for (e = epochs; e; e = e->next)
-		if ((int) e->algo == curr_algo)
-			break;
 	if (!e || e->num <= curr_epoch)
 		return 0;
 
 	debug(1, "prepend epoch %s %d (first was %u)",
 	    dagalgo_name(curr_algo), curr_epoch, e->num);
-	e = epoch_new(curr_algo, curr_epoch);
-	e->next = epochs;
-	epochs = e;
+	link_epoch(epoch_new(curr_algo, curr_epoch));
 	return 1;
 }
 
 
 static bool maybe_wipe(void)
 {
-	struct epoch **anchor = &epochs;
-	struct epoch *e = NULL;
+	struct epoch *e = epochs[curr_algo].first;
 
-	while (1) {
-		e = *anchor;
-		if (!e)
-			break;
-		if ((int) e->algo == curr_algo)
-			break;
-		anchor = &(*anchor)->next;
-	}
 	if (!e || e->num >= curr_epoch)
 		return 0;
 	
 	debug(1, "purge epoch %u (current is %d)", e->num, curr_epoch);
+	unlink_epoch(e);
 	if (e->dag_handle)
 		wipe_epoch(e);
-	*anchor = e->next;
+	else
+		cache_remove(&e->cache);
 	free_epoch(e);
 	return 1;
 }
 
 
-bool epoch_work(bool just_one)
+static void release_epoch(struct epoch *e)
 {
-	off_t sum = 0;	/* cache size in bytes, rounded to blocks */
-	struct epoch *e = epochs;
-	uint16_t next;
+	work_drain(e);
+	if (e->chunk) {
+		journal_store(e);
+		work_release(e);
+	}
+	cache_free(&e->cache);
+	/* the DAG is complete and verified, so we won't need the cache again */
+	cache_remove(&e->cache);
+}
+
+
+static bool work_epoch(struct epoch *e, bool just_one)
+{
+	struct epoch *victim;
+	uint64_t bytes;
+
+	debug(1, "epoch %s %u: %u/%u/%u lines",
+	    dagalgo_name(e->algo), e->num, e->pos, e->nominal, e->lines);
+	debug(1, "cache %lu/%lu, dag %lu/%lu",
+	    (unsigned long) cache_sum, (unsigned long) max_cache,
+	    (unsigned long) e->size, (unsigned long) e->final);
+	if (!just_one) {
+		if (cache_sum > max_cache ||
+		    cache_sum + missing(e) > max_cache) {
+			victim = pick_victim(e->algo);
+			/* We can't make room for more epochs. */
+			if (victim->algo == e->algo && victim->num <= e->num)
+				return 0;
+			debug(1, "remove epoch %u (try to make room for %u)",
+			    victim->num, e->num);
+			remove_epoch(victim);
+			return 1;
+		}
+	}
+	if (!e->dag_handle) {
+		if (!create_dag(e))
+			return 0;
+	}
+	if (!work_on(e))
+		return 0;
+
+	bytes = dagio_bytes(e->dag_handle);
+	set_size(e, disk_size(e, bytes));
+	debug(2,
+	    "update size to %llu/%llu (%llu bytes, %llu block size)",
+	    (unsigned long long) e->size, (unsigned long long) e->final,
+	    (unsigned long long) bytes, (unsigned long long) block_size);
+	return 1;
+}
+
+
+/*
+ * With look-ahead, one in LOOKAHEAD_SHARE work units goes to the epochs
+ * following the first incomplete one, up to curr_epoch + lookahead, one at a
+ * time. Epochs ahead only get work (or are added) if there is room for them and
+ * for the rest of all the epochs before them, so they never make us remove an
+ * epoch we need earlier.
+ *
+ * Light caches take tens of MB each, so only LOOKAHEAD_CACHES of the epochs
+ * ahead may have one at a time. We stay with the epoch ahead that has a cache
+ * until its DAG is complete. If we have to move on to another one, we evict
+ * the caches we can load again from their file (-c).
+ *
+ * Background verification (see enum check_phase) gets a turn whenever its
+ * budget (background_mb_s) allows, but at most one in BACKGROUND_SHARE work
+ * units, so that a DAG in use is fully verified in a predictable time. If
+ * there is nothing else to do, it gets all the turns, and we pause for its
+ * budget instead.
+ */
+
+static bool fits(off_t more)
+{
+	return cache_sum + more < max_cache;
+}
+
+
+/*
+ * Work restricted to some classes goes to the first incomplete epoch. If it
+ * has no work of these classes, but calculating caches is allowed, we continue
+ * with the cache of the epoch we would add next, so that it is ready when we
+ * can create the DAG. Epochs ahead don't get a cache here, to keep the number
+ * of caches bounded (see LOOKAHEAD_CACHES).
+ */
+
+static bool work_some(unsigned stages)
+{
+	struct epoch *e, *first = NULL;
+	unsigned next = curr_epoch;
+
+	for (e = find_epoch(curr_algo, next); e && e->num == next;
+	    e = e->next) {
+		next = e->num + 1;
+		if (!first && !epoch_done(e))
+			first = e;
+	}
+	if (first && (work_stage(first) & stages)) {
+		debug(1, "epoch %s %u: %u/%u/%u lines (stages 0x%x)",
+		    dagalgo_name(first->algo), first->num, first->pos,
+		    first->nominal, first->lines, stages);
+		return work_on(first);
+	}
+	if (!(stages & stage_cpu) || next > EPOCH_MAX)
+		return 0;
+	return prefetch_build(next);
+}
+
+
+bool epoch_work(bool just_one, unsigned stages)
+{
+	static unsigned turn = 0;
+	static unsigned since_background = 0; /* other work units since */
+	struct epoch *e, *first = NULL, *background = NULL;
+	struct epoch *ahead = NULL;	/* epoch ahead to work on */
+	struct epoch *cached = NULL;	/* epoch ahead with a light cache */
+	unsigned caches = 0;	/* light caches of epochs ahead */
+	off_t reserved = 0;	/* space still needed by the epochs before */
+	unsigned next;
 
 	debug(1, "epoch_work");
 	if (curr_algo == -1) {
@@ -424,80 +903,100 @@ bool epoch_work(bool just_one)
 		debug(2, "no current epoch");
 		return 0;
 	}
+	if (curr_epoch > EPOCH_MAX) {
+		debug(2, "epoch %d is beyond %u", curr_epoch, EPOCH_MAX);
+		return 0;
+	}
+	if (stages != stage_all)
+		return work_some(stages);
 	if (maybe_prepend())
 		return 1;
+	/*
+	 * Only prefetch the next epoch once we have the current one. Before,
+	 * the prefetch may still hold the cache of the current epoch (from the
+	 * previous prefetch, or from prefetch_build), for epoch_new to take.
+	 */
+	if (!just_one && curr_epoch < EPOCH_MAX &&
+	    find_epoch(curr_algo, curr_epoch) &&
+	    !find_epoch(curr_algo, curr_epoch + 1))
+		prefetch_start(curr_epoch + 1);
 	if (!just_one)
 		if (maybe_wipe())
 			return 1;
-	for (e = epochs; e; e = e->next)
-		sum += e->size;
 	debug(0, "total DAG cache size: %llu/%llu bytes",
-	    (unsigned long long) sum, (unsigned long long) max_cache);
+	    (unsigned long long) cache_sum, (unsigned long long) max_cache);
 	next = curr_epoch;
-	for (e = epochs; e; e = e->next) {
-		uint64_t bytes;
-
-		if (e->num < next)
-			continue;
-		if (e->num != next)
-			break;
+	for (e = find_epoch(curr_algo, next); e && e->num == next;
+	    e = e->next) {
 		next = e->num + 1;
-		if (e->pos == e->lines) {
-			if (e->chunk) {
-				free(e->chunk);
-				e->chunk = NULL;
-			}
-			cache_free(&e->cache);
+		if (epoch_done(e)) {
+			release_epoch(e);
 			continue;
 		}
-		debug(1, "epoch %s %u: %u/%u/%u lines",
-		    dagalgo_name(e->algo), e->num, e->pos, e->nominal,
-		    e->lines);
-		debug(1, "cache %lu/%lu, dag %lu/%lu",
-		    (unsigned long) sum, (unsigned long) max_cache,
-		    (unsigned long) e->size, (unsigned long) e->final);
-		if (!just_one) {
-			while (sum > max_cache ||
-			    sum + e->final - e->size > max_cache) {
-				/* We can't make room for more epochs. */
-				if (!e->next)
-					return 0;
-				debug(1,
-				    "remove epoch %u (try to make room for %u)",
-				    e->next->num, e->num);
-				remove_epoch(e->next, &sum);
-				return 1;
+		if (e->check == check_background) {
+			if (!background)
+				background = e;
+		} else if (!first) {
+			first = e;
+		} else {
+			if (e->cache.cache)
+				caches++;
+			if (e->num <= curr_epoch + lookahead &&
+			    fits(reserved + missing(e))) {
+				if (!ahead)
+					ahead = e;
+				if (e->cache.cache && !cached)
+					cached = e;
 			}
 		}
-		if (!e->dag_handle) {
-			if (!create_dag(e))
-				return 0;
+		reserved += missing(e);
+	}
+	if (cached) {
+		ahead = cached;
+	} else if (ahead && caches >= LOOKAHEAD_CACHES) {
+		for (e = first->next; e && caches >= LOOKAHEAD_CACHES;
+		    e = e->next)
+			if (e->check != check_background &&
+			    cache_evict(&e->cache))
+				caches--;
+		if (caches >= LOOKAHEAD_CACHES)
+			ahead = NULL;
+	}
+	if (first && !just_one && lookahead && turn++ % LOOKAHEAD_SHARE == 0) {
+		if (ahead)
+			return work_epoch(ahead, 0);
+		if (caches < LOOKAHEAD_CACHES &&
+		    next <= curr_epoch + lookahead &&
+		    next <= EPOCH_MAX && fits(reserved +
+		    round_to_block((off_t) get_full_lines(next) *
+		    DAG_LINE_BYTES, block_size))) {
+			debug(1, "look ahead to epoch %s %u",
+			    dagalgo_name(curr_algo), next);
+			new_epoch(curr_algo, next);
+			return 1;
 		}
-		if (!work_on(e))
-			return 0;
-
-		bytes = dagio_bytes(e->dag_handle);
-		e->size = round_to_block(bytes, block_size);
-		debug(2,
-		    "update size to %llu/%llu "
-		    "(%llu bytes, %llu block size)",
-		    (unsigned long long) e->size,
-		    (unsigned long long) e->final,
-		    (unsigned long long) bytes,
-		    (unsigned long long) block_size);
-		assert(e->size <= e->final);
+	}
+	if (first && background && !just_one &&
+	    since_background >= BACKGROUND_SHARE - 1 &&
+	    govern_background_due()) {
+		since_background = 0;
+		return work_epoch(background, 0);
+	}
+	if (since_background < BACKGROUND_SHARE)
+		since_background++;
+	if (first)
+		return work_epoch(first, just_one);
+
+	if (next <= EPOCH_MAX && (just_one ? next == (unsigned) curr_epoch :
+	    may_add(curr_algo, next))) {
+		new_epoch(curr_algo, next);
 		return 1;
 	}
-
-	if (just_one) {
-		if (next != curr_epoch)
-			return 0;
-	} else {
-		if (!may_add(curr_algo, next, sum))
-			return 0;
+	if (background) {
+		govern_pace_background();
+		return work_epoch(background, just_one);
 	}
-	new_epoch(curr_algo, next);
-	return 1;
+	return 0;
 }
 
 
@@ -506,14 +1005,16 @@ bool epoch_work(bool just_one)
 
 void epoch_init(void)
 {
+	struct epoch *first;
+
 	debug(1, "epoch_init");
-	dag_init();
 	block_size = get_block_size();
 	epoch_scan();
-	if (curr_algo == -1 && epochs)
-		curr_algo = epochs->algo;
-	if (curr_epoch == -1 && epochs)
-		curr_epoch = epochs->num;
+	first = first_epoch();
+	if (curr_algo == -1 && first)
+		curr_algo = first->algo;
+	if (curr_epoch == -1 && first)
+		curr_epoch = first->num;
 }
 
 
@@ -522,12 +1023,14 @@ void epoch_init(void)
 
 void epoch_shutdown(void)
 {
+	enum dag_algo algo;
 	struct epoch *e;
 
 	debug(1, "epoch_shutdown");
-	while (epochs) {
-		e = epochs;
-		epochs = e->next;
-		free_epoch(e);
-	}
+	prefetch_cancel();
+	for (algo = 0; algo != dag_algos; algo++)
+		while ((e = epochs[algo].first)) {
+			unlink_epoch(e);
+			free_epoch(e);
+		}
 }
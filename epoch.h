@@ -17,6 +17,8 @@
 #include "linzhi/dagio.h"
 
 #include "cache.h"
+#include "io.h"
+#include "range.h"
 
 
 /*
@@ -30,25 +32,53 @@
 				   (* 2 for ETC), but we can zombie-mine beyond
 				   this. 120 more epochs should be more than
 				   enough. */
+#define	LOOKAHEAD_MAX	16	/* maximum number of epochs to look ahead */
+#define	LOOKAHEAD_SHARE	4	/* 1/LOOKAHEAD_SHARE of the work goes to
+				   epochs ahead */
+#define	LOOKAHEAD_CACHES 1	/* light caches kept for epochs ahead */
+#define	BACKGROUND_SHARE 2	/* at most 1/BACKGROUND_SHARE of the work goes
+				   to background verification */
+
+/*
+ * With fast start, a DAG that is complete when we find it is first verified
+ * by checking a sample of its chunks, and if they are all good, the DAG is
+ * considered usable while the rest is verified slowly, in the background.
+ * With verify_all, a DAG the journal says is completely verified is verified
+ * again in the background ("reverify"), and its journal keeps trusting it
+ * unless we find a bad chunk.
+ */
+
+enum check_phase {
+	check_full,		/* verify everything before using the DAG */
+	check_sample,		/* verify a sample of chunks next */
+	check_background,	/* sample was good, verify the rest slowly */
+};
 
 struct epoch {
 	char		*path;	/* path to DAG file */
 	enum dag_algo	algo;	/* algorithm */
 	uint16_t	num;	/* epoch number */
 	struct dag_handle *dag_handle; /* NULL if none yet */
-	int		csum_fd;/* checksum file for epoch; < 0 if missing */
+	uint8_t		*csum;	/* checksums of the epoch; NULL if missing */
 	uint32_t	pos;	/* current line being verified/calculated */
+	enum check_phase check; /* how we verify the DAG */
+	bool		reverify; /* background pass over a trusted DAG */
+	struct range	*bad;	/* lines before pos that need to be
+				   generated again */
 	uint32_t	nominal;/* number of lines nominally present in file */
 	uint32_t	lines;	/* total number of lines */
-	off_t		size;	/* size in bytes (rounded to disk blocks) */
+	off_t		size;	/* disk space used, in bytes */
 	off_t		final;	/* final size in bytes (rounded) */
 	struct cache	cache;	/* Ethash cache */
 	uint8_t		*chunk;	/* buffer */
-	struct epoch	*next;	/* next epoch */
+	struct io_req	io[IO_SLOTS]; /* I/O on each part of the buffer */
+	unsigned	slot;	/* part of the buffer to use next */
+	int		map_fd;	/* DAG file for mmap_verify; < 0 if closed */
+	struct epoch	*prev;	/* previous epoch of the same algorithm */
+	struct epoch	*next;	/* next epoch of the same algorithm */
 };
 
 
-extern struct epoch *epochs;
 extern const char *dag_path_template;
 extern const char *csum_path_template;	/* may be NULL */
 
@@ -60,16 +90,77 @@ extern const char *csum_path_template;	/* may be NULL */
 
 extern off_t max_cache;
 
+/*
+ * Number of epochs after the current one that are prepared, at a lower
+ * priority, while the current one is still incomplete.
+ */
+
+extern unsigned lookahead;
+
+/*
+ * Verify complete DAGs found at startup by sampling first, see enum
+ * check_phase.
+ */
+
+extern bool fast_start;
+
+/*
+ * Verify DAGs the journal already trusts again, in the background, see enum
+ * check_phase.
+ */
+
+extern bool verify_all;
+
 
 bool template_valid(const char *s);
 
 char *epoch_report(void);
 
+/*
+ * epoch_metrics returns the performance metrics (see metrics.h), followed by
+ * the estimated time to completion of each incomplete epoch, as
+ * "eta=algo:epoch:seconds,...", with -1 for seconds if not known yet. The
+ * caller frees the string.
+ */
+
+char *epoch_metrics(void);
+
+/*
+ * epoch_done returns 1 if the DAG of the epoch is complete and verified.
+ */
+
+bool epoch_done(const struct epoch *e);
+
+/*
+ * epoch_complete returns the path of the DAG file of the epoch, and sets
+ * *lines, if we have the epoch and its DAG is complete and verified.
+ * Otherwise, it returns NULL.
+ */
+
+const char *epoch_complete(enum dag_algo algo, unsigned n, uint32_t *lines);
+
+/*
+ * Classes of DAG work, by the resources they need. Calculating caches only
+ * uses the CPU (stored caches are small compared to DAGs), verification reads
+ * DAG files, and generation writes them.
+ */
+
+enum stage {
+	stage_cpu	= 1 << 0,
+	stage_read	= 1 << 1,
+	stage_write	= 1 << 2,
+	stage_all	= stage_cpu | stage_read | stage_write,
+};
+
 /*
  * epoch_work returns 1 if there is more work to do and we should call it again
  * soon, 0 if there won't be any work left before the next epoch change.
+ *
+ * "stages" is a mask of the classes of work that may be done. Unless it is
+ * stage_all, epoch_work does not add, remove, or create DAGs, and it returns 0
+ * if there is no work of the allowed classes.
  */
-bool epoch_work(bool just_one);
+bool epoch_work(bool just_one, unsigned stages);
 void epoch_init(void);
 void epoch_shutdown(void);
 
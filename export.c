@@ -0,0 +1,493 @@
+/*
+ * export.c - Hand out complete DAGs in shared memory
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for memfd_create, accept4 */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "linzhi/dag.h"
+#include "linzhi/dagalgo.h"
+#include "linzhi/dagio.h"
+
+#include "debug.h"
+#include "csum.h"
+#include "mqtt.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "govern.h"
+#include "buf.h"
+#include "export.h"
+
+
+#define	CLIENTS_MAX	8
+#define	CLIENT_TIMEOUT_S 5	/* for receiving the request, checked when the
+				   main loop runs */
+#define	HOLD_POLL_MS	100	/* how often the copy checks if a hold ended */
+
+
+const char *export_path = NULL;
+
+static int listen_fd = -1;
+
+/*
+ * We keep the shared memory of the last DAG we handed out, so that several
+ * clients can get it without us copying it again. This costs as much memory as
+ * the DAG (several GB), so we only copy a DAG when a client asks for it, keep
+ * only one, and drop it when the epoch is no longer current.
+ */
+
+static struct exported {
+	enum dag_algo	algo;
+	uint16_t	epoch;
+	uint64_t	bytes;	/* size of the DAG */
+	int		fd;	/* memfd; < 0 if none */
+} exported = { .fd = -1 };
+
+/*
+ * Copying a DAG into shared memory takes seconds, so a thread does it, with
+ * its own handle of the DAG file. When the thread is done, it signals done_fd,
+ * and we then hand the DAG to the clients waiting for it.
+ */
+
+static struct copy {
+	enum dag_algo		algo;
+	uint16_t		epoch;
+	uint32_t		lines;
+	struct dag_handle	*dag;
+	int			fd;	/* memfd, set by the thread */
+	pthread_t		thread;
+	bool			running;
+} copy;
+
+static int done_fd = -1;	/* eventfd */
+
+/*
+ * Client sockets are non-blocking. We collect the request as it arrives, and
+ * a client may then have to wait for its DAG to be copied.
+ */
+
+static struct client {
+	int		fd;	/* < 0 if unused */
+	uint64_t	t0;	/* now_us() when accepted */
+	char		buf[EXPORT_MSG_MAX];
+	size_t		len;
+	bool		waiting; /* for algo and epoch */
+	enum dag_algo	algo;
+	uint16_t	epoch;
+} clients[CLIENTS_MAX];
+
+
+/* ----- Shared memory ----------------------------------------------------- */
+
+
+/*
+ * The copy reads the DAG file like the rest of the DAG work, so it draws on
+ * the same budgets, and it waits while we hold (see mqtt.h).
+ */
+
+static void pace(struct govern_thread *gov, uint64_t bytes)
+{
+	unsigned ms = govern_thread_delay_ms(gov, bytes);
+	struct timespec ts;
+
+	while (1) {
+		if (ms) {
+			ts.tv_sec = ms / 1000;
+			ts.tv_nsec = ms % 1000 * 1000000L;
+			nanosleep(&ts, NULL);
+		}
+		if (!__atomic_load_n(&hold, __ATOMIC_RELAXED))
+			return;
+		ms = HOLD_POLL_MS;
+	}
+}
+
+
+/*
+ * We first try a memfd backed by huge pages, so that uploaders get fewer TLB
+ * misses, and if this fails (e.g., because no huge pages are reserved, or the
+ * kernel can't seal them), we use a regular one.
+ */
+
+static int fill_memfd(unsigned flags, const char *name,
+    struct dag_handle *dag, uint32_t lines, struct govern_thread *gov)
+{
+	uint64_t bytes = (uint64_t) lines * DAG_LINE_BYTES;
+	uint64_t size = bytes;
+	uint32_t pos, n;
+	uint8_t *map;
+	int fd;
+
+	if (flags & MFD_HUGETLB)
+		size = (bytes + HUGE_PAGE_BYTES - 1) &
+		    ~(uint64_t) (HUGE_PAGE_BYTES - 1);
+	fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0)
+		goto fail;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	for (pos = 0; pos != lines; pos += n) {
+		n = lines - pos < LINES_PER_CHUNK ? lines - pos :
+		    LINES_PER_CHUNK;
+		dagio_pread(dag, map + (size_t) pos * DAG_LINE_BYTES, n, pos);
+		pace(gov, (uint64_t) n * DAG_LINE_BYTES);
+	}
+	/* sealing against writes requires that there are no writable maps */
+	munmap(map, size);
+	if (fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto fail;
+	return fd;
+
+fail:
+	debug(1, "export: %s%s: %s", name, flags & MFD_HUGETLB ?
+	    " (huge pages)" : "", strerror(errno));
+	close(fd);
+	return -1;
+}
+
+
+static void *copy_thread(void *arg)
+{
+	struct govern_thread gov = { 0 };
+	char name[32];
+	uint64_t one = 1;
+	int fd;
+
+	snprintf(name, sizeof(name), "dag-%s-%u", dagalgo_name(copy.algo),
+	    copy.epoch);
+	debug(1, "export: %s, %u lines", name, copy.lines);
+	govern_thread_delay_ms(&gov, 0);
+	fd = fill_memfd(MFD_HUGETLB | HUGE_PAGE_FLAGS, name, copy.dag,
+	    copy.lines, &gov);
+	if (fd < 0)
+		fd = fill_memfd(0, name, copy.dag, copy.lines, &gov);
+	if (fd < 0)
+		perror("memfd");
+	copy.fd = fd;
+	if (write(done_fd, &one, sizeof(one)) < 0)
+		perror("export: eventfd");
+	return NULL;
+}
+
+
+static bool start_copy(enum dag_algo algo, uint16_t epoch)
+{
+	const char *path;
+	int err;
+
+	path = epoch_complete(algo, epoch, &copy.lines);
+	if (!path)
+		return 0;
+	copy.dag = dagio_try_open(path, O_RDONLY, copy.lines);
+	if (!copy.dag) {
+		perror(path);
+		return 0;
+	}
+	copy.algo = algo;
+	copy.epoch = epoch;
+	err = pthread_create(&copy.thread, NULL, copy_thread, NULL);
+	if (err) {
+		fprintf(stderr, "export: pthread_create: %s\n", strerror(err));
+		dagio_close(copy.dag);
+		return 0;
+	}
+	copy.running = 1;
+	return 1;
+}
+
+
+static bool is_exported(enum dag_algo algo, uint16_t epoch)
+{
+	return exported.fd >= 0 && exported.algo == algo &&
+	    exported.epoch == epoch;
+}
+
+
+/* ----- Socket ------------------------------------------------------------ */
+
+
+static void reply(int client, const char *msg, int fd)
+{
+	struct iovec iov = {
+		.iov_base	= (void *) msg,
+		.iov_len	= strlen(msg),
+	};
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	struct cmsghdr *cmsg;
+
+	if (fd >= 0) {
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	/* the reply is short, so it fits into the empty socket buffer */
+	if (sendmsg(client, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		perror("export: sendmsg");
+}
+
+
+static void finish(struct client *c, const char *msg, int fd)
+{
+	reply(c->fd, msg, fd);
+	mqtt_unwatch(c->fd);
+	close(c->fd);
+	c->fd = -1;
+}
+
+
+static void answer(struct client *c)
+{
+	char buf[EXPORT_MSG_MAX];
+
+	if (!is_exported(c->algo, c->epoch)) {
+		finish(c, "error not available\n", -1);
+		return;
+	}
+	snprintf(buf, sizeof(buf), "%llu\n",
+	    (unsigned long long) exported.bytes);
+	finish(c, buf, exported.fd);
+}
+
+
+/*
+ * Answer the waiting clients whose DAG we have, and start copying the DAG the
+ * next one is waiting for, unless we hold. Clients asking for a DAG we can't
+ * provide get an error.
+ */
+
+static void serve_waiting(void)
+{
+	struct client *c;
+
+	for (c = clients; c != clients + CLIENTS_MAX; c++) {
+		if (c->fd < 0 || !c->waiting)
+			continue;
+		if (is_exported(c->algo, c->epoch)) {
+			answer(c);
+			continue;
+		}
+		if (copy.running || hold)
+			continue;
+		if (!start_copy(c->algo, c->epoch))
+			answer(c);
+	}
+}
+
+
+static void copied(int fd)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0) {
+		if (errno != EAGAIN)
+			perror("export: eventfd");
+		return;
+	}
+	pthread_join(copy.thread, NULL);
+	copy.running = 0;
+	dagio_close(copy.dag);
+	if (copy.fd >= 0) {
+		if (exported.fd >= 0)
+			close(exported.fd);
+		exported.algo = copy.algo;
+		exported.epoch = copy.epoch;
+		exported.bytes = (uint64_t) copy.lines * DAG_LINE_BYTES;
+		exported.fd = copy.fd;
+	}
+	serve_waiting();
+}
+
+
+static void request(struct client *c)
+{
+	char name[EXPORT_MSG_MAX];
+	unsigned epoch;
+	int algo;
+
+	if (sscanf(c->buf, "%s %u", name, &epoch) != 2) {
+		finish(c, "error bad request\n", -1);
+		return;
+	}
+	algo = dagalgo_code(name);
+	if (algo == -1 || epoch > EPOCH_MAX) {
+		finish(c, "error unknown DAG\n", -1);
+		return;
+	}
+	debug(1, "export: request for %s epoch %u", name, epoch);
+	c->waiting = 1;
+	c->algo = algo;
+	c->epoch = epoch;
+	serve_waiting();
+}
+
+
+static void receive(int fd)
+{
+	struct client *c;
+	char dummy;
+	ssize_t got;
+
+	for (c = clients; c != clients + CLIENTS_MAX; c++)
+		if (c->fd == fd)
+			break;
+	assert(c != clients + CLIENTS_MAX);
+	/* a waiting client must not send anything else */
+	got = c->waiting ? read(fd, &dummy, 1) :
+	    read(fd, c->buf + c->len, EXPORT_MSG_MAX - 1 - c->len);
+	if (got < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("export: read");
+	}
+	if (got > 0 && c->waiting) {
+		finish(c, "error bad request\n", -1);
+		return;
+	}
+	if (got <= 0) {
+		mqtt_unwatch(fd);
+		close(fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += got;
+	c->buf[c->len] = 0;
+	if (memchr(c->buf, '\n', c->len))
+		request(c);
+	else if (c->len == EXPORT_MSG_MAX - 1)
+		finish(c, "error bad request\n", -1);
+}
+
+
+static void serve(int fd)
+{
+	struct client *c;
+	int client;
+
+	while (1) {
+		client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("export: accept4");
+			return;
+		}
+		for (c = clients; c != clients + CLIENTS_MAX; c++)
+			if (c->fd < 0)
+				break;
+		if (c == clients + CLIENTS_MAX || !mqtt_watch(client, receive)) {
+			reply(client, "error busy\n", -1);
+			close(client);
+			continue;
+		}
+		c->fd = client;
+		c->t0 = now_us();
+		c->len = 0;
+		c->waiting = 0;
+	}
+}
+
+
+void export_update(void)
+{
+	struct client *c;
+	uint64_t now;
+
+	if (!export_path)
+		return;
+
+	now = now_us();
+	for (c = clients; c != clients + CLIENTS_MAX; c++)
+		if (c->fd >= 0 && !c->waiting &&
+		    now - c->t0 > CLIENT_TIMEOUT_S * 1000000ULL) {
+			debug(1, "export: client timed out");
+			mqtt_unwatch(c->fd);
+			close(c->fd);
+			c->fd = -1;
+		}
+
+	if (curr_algo == -1 || curr_epoch == -1)
+		return;
+	if (exported.fd >= 0 && ((int) exported.algo != curr_algo ||
+	    (int) exported.epoch != curr_epoch)) {
+		debug(1, "export: drop %s epoch %u",
+		    dagalgo_name(exported.algo), exported.epoch);
+		close(exported.fd);
+		exported.fd = -1;
+	}
+	if (!hold)
+		serve_waiting();
+}
+
+
+void export_init(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct client *c;
+
+	if (!export_path)
+		return;
+	if (strlen(export_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", export_path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, export_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (listen_fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	/* remove a stale socket left behind by a previous run */
+	if (unlink(export_path) < 0 && errno != ENOENT) {
+		perror(export_path);
+		exit(1);
+	}
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 4) < 0) {
+		perror(export_path);
+		exit(1);
+	}
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (done_fd < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	for (c = clients; c != clients + CLIENTS_MAX; c++)
+		c->fd = -1;
+	mqtt_watch(listen_fd, serve);
+	mqtt_watch(done_fd, copied);
+}
@@ -0,0 +1,41 @@
+/*
+ * export.h - Hand out complete DAGs in shared memory
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_EXPORT_H
+#define	DAGD_EXPORT_H
+
+/*
+ * Protocol: the client connects to the Unix socket at export_path and sends
+ * "algorithm epoch\n". If the DAG is complete and verified, dagd replies with
+ * "bytes\n", where "bytes" is the size of the DAG, and passes a file
+ * descriptor (SCM_RIGHTS) of a sealed memfd containing the DAG, starting at
+ * offset zero. The memfd may be larger than the DAG. Otherwise, the reply is
+ * "error reason\n", without a file descriptor. dagd then closes the
+ * connection. The reply may take a few seconds if dagd still has to copy the
+ * DAG into shared memory, which it only does when the first client asks.
+ */
+
+#define	EXPORT_MSG_MAX	64	/* maximum length of a request or reply */
+
+
+extern const char *export_path;	/* NULL if not exporting */
+
+
+/*
+ * export_init creates the socket and adds it to the MQTT event loop, if
+ * export_path is set. export_update drops the shared memory of a DAG that is
+ * no longer current (clients that already have the file descriptor can keep
+ * using it), drops clients that don't send their request in time, and starts
+ * copying a DAG a client is waiting for once a hold has ended.
+ */
+
+void export_init(void);
+void export_update(void);
+
+#endif /* !DAGD_EXPORT_H */
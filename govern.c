@@ -0,0 +1,211 @@
+/*
+ * govern.c - Limit CPU and I/O use of DAG work
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "pool.h"
+#include "govern.h"
+
+
+enum resource {
+	res_cpu,
+	res_read,
+	res_write,
+	res_background,
+	res_n
+};
+
+
+struct budget budget[2] = {
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+};
+unsigned background_mb_s = 20;
+
+/*
+ * Each resource is "paid off" at ready[r], in now_us() time. Using a resource
+ * moves this time forward by how long we would need to use the amount at the
+ * budgeted rate. If ready[r] is in the future, we pause until then. Since
+ * ready[r] never lags behind the present time when we add to it, pausing for
+ * other reasons doesn't build up credit for bursts later.
+ *
+ * Other threads draw on the same budgets, so "lock" protects all this state.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ready[res_n];
+static uint64_t used[res_n];	/* not yet accounted for in ready[] */
+static uint64_t last_cpu_us = 0;
+static enum govern_mode last_mode = govern_idle; /* for other threads */
+static bool pace_background = 0;
+
+
+/* ----- Option parsing ---------------------------------------------------- */
+
+
+bool govern_parse(unsigned *running, unsigned *idle, const char *arg)
+{
+	char *end;
+
+	*running = strtoul(arg, &end, 0);
+	if (end == arg)
+		return 0;
+	if (*end == '/') {
+		arg = end + 1;
+		*idle = strtoul(arg, &end, 0);
+		if (end == arg)
+			return 0;
+	} else {
+		*idle = *running;
+	}
+	return !*end;
+}
+
+
+/* ----- Accounting -------------------------------------------------------- */
+
+
+void govern_io(bool write, uint64_t bytes)
+{
+	pthread_mutex_lock(&lock);
+	used[write ? res_write : res_read] += bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void govern_background(uint64_t bytes)
+{
+	pthread_mutex_lock(&lock);
+	used[res_background] += bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+
+bool govern_background_due(void)
+{
+	uint64_t now = now_us();
+	bool due;
+
+	pthread_mutex_lock(&lock);
+	due = ready[res_background] <= now;
+	pthread_mutex_unlock(&lock);
+	return due;
+}
+
+
+void govern_pace_background(void)
+{
+	pace_background = 1;
+}
+
+
+/*
+ * "rate" is in units per second, with CPU time in microseconds and I/O in
+ * bytes.
+ */
+
+static void charge(enum resource r, double rate, uint64_t now)
+{
+	if (!rate) {
+		ready[r] = 0;
+	} else {
+		if (ready[r] < now)
+			ready[r] = now;
+		ready[r] += used[r] * 1e6 / rate;
+	}
+	used[r] = 0;
+}
+
+
+unsigned govern_delay_ms(enum govern_mode mode)
+{
+	const struct budget *b = budget + mode;
+	uint64_t now = now_us();
+	uint64_t cpu = pool_cpu_us();
+	uint64_t until = 0;
+	enum resource r;
+
+	pthread_mutex_lock(&lock);
+	last_mode = mode;
+	if (last_cpu_us)
+		used[res_cpu] += cpu - last_cpu_us;
+	last_cpu_us = cpu;
+
+	charge(res_cpu, b->cpu_pct * 1e4, now);
+	charge(res_read, b->read_mb_s * 1e6, now);
+	charge(res_write, b->write_mb_s * 1e6, now);
+	charge(res_background, background_mb_s * 1e6, now);
+
+	for (r = 0; r != res_n; r++)
+		if (ready[r] > until &&
+		    (r != res_background || pace_background))
+			until = ready[r];
+	pace_background = 0;
+	pthread_mutex_unlock(&lock);
+	if (until <= now)
+		return 0;
+	debug(2, "govern: pause %llu us", (unsigned long long) (until - now));
+	return (until - now + 999) / 1000;
+}
+
+
+void govern_sleep(enum govern_mode mode)
+{
+	unsigned ms = govern_delay_ms(mode);
+	struct timespec ts = {
+		.tv_sec		= ms / 1000,
+		.tv_nsec	= ms % 1000 * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+
+/* ----- Other threads ----------------------------------------------------- */
+
+
+static uint64_t thread_cpu_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+unsigned govern_thread_delay_ms(struct govern_thread *t, uint64_t read_bytes)
+{
+	const struct budget *b;
+	uint64_t now = now_us();
+	uint64_t cpu = thread_cpu_us();
+	uint64_t until;
+
+	pthread_mutex_lock(&lock);
+	b = budget + last_mode;
+	if (t->last_cpu_us)
+		used[res_cpu] += cpu - t->last_cpu_us;
+	t->last_cpu_us = cpu;
+	used[res_read] += read_bytes;
+	charge(res_cpu, b->cpu_pct * 1e4, now);
+	charge(res_read, b->read_mb_s * 1e6, now);
+	until = ready[res_cpu] > ready[res_read] ?
+	    ready[res_cpu] : ready[res_read];
+	pthread_mutex_unlock(&lock);
+	if (until <= now)
+		return 0;
+	return (until - now + 999) / 1000;
+}
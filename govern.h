@@ -0,0 +1,94 @@
+/*
+ * govern.h - Limit CPU and I/O use of DAG work
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_GOVERN_H
+#define	DAGD_GOVERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * Budgets, as percent of one CPU core and MB/s. 0 means unlimited. One set of
+ * budgets applies while the miner is running, the other while it is idle or
+ * if we don't know its state (without MQTT).
+ */
+
+struct budget {
+	unsigned	cpu_pct;
+	unsigned	read_mb_s;
+	unsigned	write_mb_s;
+};
+
+enum govern_mode {
+	govern_running	= 0,
+	govern_idle	= 1,
+};
+
+extern struct budget budget[2];	/* indexed by enum govern_mode */
+
+
+/*
+ * govern_parse sets the limits for both modes from "arg", which is either a
+ * single value for both, or "running/idle". It returns 0 if "arg" is not
+ * valid.
+ */
+
+bool govern_parse(unsigned *running, unsigned *idle, const char *arg);
+
+/*
+ * govern_io accounts for DAG data read or written. It must only be called from
+ * the main thread.
+ */
+
+void govern_io(bool write, uint64_t bytes);
+
+/*
+ * govern_background accounts for DAG data read for background verification.
+ * This is limited to background_mb_s in addition to any other budgets.
+ *
+ * Background verification is interleaved with other work, which must not have
+ * to wait for its budget. govern_background_due returns 1 if the budget allows
+ * more background verification now. Only if background verification is all
+ * that is left to do, the caller announces this with govern_pace_background,
+ * and the next call to govern_delay_ms also pauses for its budget.
+ */
+
+extern unsigned background_mb_s;
+
+void govern_background(uint64_t bytes);
+bool govern_background_due(void);
+void govern_pace_background(void);
+
+/*
+ * govern_delay_ms accounts for the CPU time used since the last call and
+ * returns how long we have to pause DAG work to stay within the budgets of
+ * the current mode. govern_sleep pauses for that long.
+ */
+
+unsigned govern_delay_ms(enum govern_mode mode);
+void govern_sleep(enum govern_mode mode);
+
+/*
+ * govern_delay_ms only measures the CPU time of the main thread and the
+ * worker pool. Other threads doing DAG work (the prefetch and export threads)
+ * account for their own CPU time and the bytes they read since the last call
+ * with govern_thread_delay_ms, which they call after each step, with "t"
+ * initialized to zero. Their use counts against the same budgets, in the mode
+ * of the main thread's last call to govern_delay_ms, and they pause for as
+ * long as govern_thread_delay_ms returns.
+ */
+
+struct govern_thread {
+	uint64_t	last_cpu_us;	/* thread CPU time at the last call */
+};
+
+unsigned govern_thread_delay_ms(struct govern_thread *t, uint64_t read_bytes);
+
+#endif /* !DAGD_GOVERN_H */
@@ -0,0 +1,122 @@
+/*
+ * io.c - Background DAG I/O
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "linzhi/dagio.h"
+
+#include "debug.h"
+#include "io.h"
+
+
+bool io_async = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER;
+static struct io_req *queue = NULL;
+static struct io_req **tail = &queue;
+
+
+static void execute(const struct io_req *req)
+{
+	debug(3, "io: %s %u lines at %u", req->write ? "write" : "read",
+	    req->lines, req->pos);
+	if (req->write)
+		dagio_pwrite(req->handle, req->buf, req->lines, req->pos);
+	else
+		dagio_pread(req->handle, req->buf, req->lines, req->pos);
+}
+
+
+static void *io_thread(void *arg)
+{
+	struct io_req *req;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!queue)
+			pthread_cond_wait(&queued, &lock);
+		req = queue;
+		pthread_mutex_unlock(&lock);
+
+		execute(req);
+
+		pthread_mutex_lock(&lock);
+		queue = req->next;
+		if (!queue)
+			tail = &queue;
+		req->busy = 0;
+		pthread_cond_broadcast(&completed);
+	}
+	return NULL;
+}
+
+
+void io_submit(struct io_req *req)
+{
+	if (!io_async) {
+		execute(req);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	req->busy = 1;
+	req->next = NULL;
+	*tail = req;
+	tail = &req->next;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&lock);
+}
+
+
+void io_wait(struct io_req *req)
+{
+	if (!io_async)
+		return;
+	pthread_mutex_lock(&lock);
+	while (req->busy)
+		pthread_cond_wait(&completed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+
+void io_req_init(struct io_req *req)
+{
+	req->handle = NULL;
+	req->buf = NULL;
+	req->lines = 0;
+	req->pos = 0;
+	req->write = 0;
+	req->busy = 0;
+	req->next = NULL;
+}
+
+
+void io_init(bool async)
+{
+	pthread_t thread;
+	int err;
+
+	if (!async)
+		return;
+	err = pthread_create(&thread, NULL, io_thread, NULL);
+	if (err) {
+		fprintf(stderr,
+		    "warning: no I/O thread (%s), using synchronous I/O\n",
+		    strerror(err));
+		return;
+	}
+	pthread_detach(thread);
+	io_async = 1;
+}
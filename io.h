@@ -0,0 +1,55 @@
+/*
+ * io.h - Background DAG I/O
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_IO_H
+#define	DAGD_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "linzhi/dagio.h"
+
+
+#define	IO_SLOTS	2	/* requests per epoch (double-buffering) */
+
+
+struct io_req {
+	struct dag_handle *handle;
+	uint8_t		*buf;
+	uint32_t	lines;
+	uint32_t	pos;	/* first line */
+	bool		write;	/* 0 for read, 1 for write */
+	bool		busy;	/* submitted but not yet completed */
+	struct io_req	*next;	/* next in queue */
+};
+
+
+/*
+ * If io_async is 0, I/O requests are executed immediately by io_submit.
+ * Otherwise, they are queued and executed in submission order by the I/O
+ * thread.
+ */
+
+extern bool io_async;
+
+
+void io_submit(struct io_req *req);
+
+/*
+ * io_wait returns when "req" has completed. It is safe to call io_wait for
+ * requests that have never been submitted, provided they were initialized
+ * with io_req_init.
+ */
+
+void io_wait(struct io_req *req);
+
+void io_req_init(struct io_req *req);
+void io_init(bool async);
+
+#endif /* !DAGD_IO_H */
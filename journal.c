@@ -0,0 +1,248 @@
+/*
+ * journal.c - Record how much of a DAG file has been verified
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Each DAG file can have a journal next to it, named <dag>.journal, that
+ * records how many lines at the beginning of the DAG have been generated or
+ * verified, the ranges among them that failed verification, and the identity
+ * of the file at that time (inode, size, and modification time). If the file
+ * is unchanged when we open it again, we can resume from there instead of
+ * verifying the whole DAG.
+ *
+ * Any write to the DAG changes its modification time, so a journal never
+ * applies to a file that was modified after the journal was written, e.g., if
+ * dagd crashed while generating the DAG.
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "linzhi/alloc.h"
+#include "linzhi/dagalgo.h"
+
+#include "debug.h"
+#include "csum.h"
+#include "range.h"
+#include "journal.h"
+
+
+#define	JOURNAL_MAGIC	"DAGDJN2"
+
+/*
+ * The header is followed by "bad" pairs of uint32_t, with the first and the
+ * end line of each bad range.
+ */
+
+struct journal_file {
+	char		magic[8];	/* JOURNAL_MAGIC, NUL-terminated */
+	uint64_t	ino;
+	uint64_t	size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint32_t	lines;		/* total lines in the DAG */
+	uint32_t	pos;		/* lines generated or verified */
+	uint32_t	bad;		/* number of bad ranges */
+	uint32_t	reserved;	/* 0 */
+};
+
+
+static char *journal_path(const struct epoch *e)
+{
+	char *path;
+
+	if (asprintf(&path, "%s.journal", e->path) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return path;
+}
+
+
+static void identity(struct journal_file *j, const struct stat *st)
+{
+	j->ino = st->st_ino;
+	j->size = st->st_size;
+	j->mtime_sec = st->st_mtim.tv_sec;
+	j->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+
+bool journal_load(struct epoch *e)
+{
+	struct journal_file j, id;
+	uint32_t *bad = NULL;
+	uint32_t last = 0;
+	struct stat st;
+	char *path;
+	size_t bytes;
+	ssize_t got;
+	unsigned i;
+	int fd;
+
+	path = journal_path(e);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror(path);
+		free(path);
+		return 0;
+	}
+	got = read(fd, &j, sizeof(j));
+	if (got < 0)
+		perror(path);
+	if (got != sizeof(j) || strcmp(j.magic, JOURNAL_MAGIC) ||
+	    j.lines != e->lines || j.pos > e->lines || j.bad > j.pos) {
+		close(fd);
+		goto stale;
+	}
+	bytes = (size_t) j.bad * 2 * sizeof(uint32_t);
+	bad = alloc_size(bytes + 1);
+	got = read(fd, bad, bytes);
+	if (got < 0)
+		perror(path);
+	close(fd);
+	if (got != (ssize_t) bytes)
+		goto stale;
+	for (i = 0; i != j.bad; i++) {
+		if (bad[2 * i] < last || bad[2 * i] >= bad[2 * i + 1] ||
+		    bad[2 * i + 1] > j.pos)
+			goto stale;
+		last = bad[2 * i + 1];
+	}
+	if (stat(e->path, &st) < 0) {
+		perror(e->path);
+		goto stale;
+	}
+	identity(&id, &st);
+	if (j.ino != id.ino || j.size != id.size ||
+	    j.mtime_sec != id.mtime_sec || j.mtime_nsec != id.mtime_nsec ||
+	    j.pos > e->nominal)
+		goto stale;
+
+	/* resume at a chunk boundary, since verification works on chunks */
+	e->pos = j.pos == e->lines ? j.pos : j.pos - j.pos % LINES_PER_CHUNK;
+	for (i = 0; i != j.bad; i++)
+		range_add(&e->bad, bad[2 * i],
+		    bad[2 * i + 1] < e->pos ? bad[2 * i + 1] : e->pos);
+	debug(1, "journal: %s at %u/%u lines, %u bad range(s)",
+	    e->path, e->pos, e->lines, range_count(e->bad));
+	free(bad);
+	free(path);
+	return 1;
+
+stale:
+	debug(1, "journal: ignoring %s", path);
+	free(bad);
+	free(path);
+	return 0;
+}
+
+
+void journal_store(const struct epoch *e)
+{
+	struct journal_file *j;
+	const struct range *r;
+	uint32_t *bad;
+	size_t size;
+	struct stat st;
+	char *path, *tmp;
+	ssize_t wrote;
+	int fd;
+
+	if (!e->pos && !e->reverify) {
+		journal_remove(e);
+		return;
+	}
+
+	/*
+	 * The journal must not make it to disk before the data it describes.
+	 */
+	fd = open(e->path, O_RDONLY);
+	if (fd < 0) {
+		perror(e->path);
+		return;
+	}
+	if (fdatasync(fd) < 0 || fstat(fd, &st) < 0) {
+		perror(e->path);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	size = sizeof(*j) + range_count(e->bad) * 2 * sizeof(uint32_t);
+	j = alloc_size(size);
+	memset(j, 0, sizeof(*j));
+	strcpy(j->magic, JOURNAL_MAGIC);
+	identity(j, &st);
+	j->lines = e->lines;
+	/* re-verification doesn't make the DAG less trustworthy */
+	j->pos = e->reverify ? e->lines : e->pos;
+	j->bad = range_count(e->bad);
+	bad = (uint32_t *) (j + 1);
+	for (r = e->bad; r; r = r->next) {
+		*bad++ = r->from;
+		*bad++ = r->to;
+	}
+
+	path = journal_path(e);
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(tmp);
+		goto out;
+	}
+	wrote = write(fd, j, size);
+	if (wrote != (ssize_t) size) {
+		if (wrote < 0)
+			perror(tmp);
+		else
+			fprintf(stderr, "%s: short write\n", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, path) < 0) {
+		perror(path);
+		unlink(tmp);
+		goto out;
+	}
+	debug(1, "journal: %s at %u/%u lines, %u bad range(s)",
+	    e->path, e->pos, e->lines, j->bad);
+
+out:
+	free(tmp);
+	free(path);
+	free(j);
+}
+
+
+void journal_remove(const struct epoch *e)
+{
+	char *path = journal_path(e);
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		perror(path);
+	free(path);
+}
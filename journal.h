@@ -0,0 +1,35 @@
+/*
+ * journal.h - Record how much of a DAG file has been verified
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_JOURNAL_H
+#define	DAGD_JOURNAL_H
+
+#include <stdbool.h>
+
+#include "epoch.h"
+
+
+/*
+ * journal_load sets e->pos to the number of lines recorded in the journal of
+ * the DAG, if there is one and the DAG file has not changed since it was
+ * written. Returns 1 if it could use the journal.
+ */
+
+bool journal_load(struct epoch *e);
+
+/*
+ * journal_store flushes the DAG file to disk and records e->pos, or that the
+ * whole DAG is good while we re-verify it (e->reverify). All writes to the
+ * file must have completed.
+ */
+
+void journal_store(const struct epoch *e);
+void journal_remove(const struct epoch *e);
+
+#endif /* !DAGD_JOURNAL_H */
@@ -0,0 +1,178 @@
+/*
+ * metrics.c - Performance metrics
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "linzhi/dag.h"
+
+#include "cache.h"
+#include "range.h"
+#include "epoch.h"
+#include "govern.h"
+#include "metrics.h"
+
+
+#define	LATENCY_SAMPLES	128	/* work units for latency percentiles */
+#define	SMOOTHING	0.2	/* weight of the newest sample in averages */
+
+
+/*
+ * Rates are exponentially weighted averages over work units, so that they
+ * follow changes in load (e.g., switching between generation and
+ * verification, or other processes competing for the CPU) within a few
+ * seconds. 0 means no sample yet.
+ */
+
+static double gen_lines_s = 0;
+static double verify_bytes_s = 0;
+static double round_us = 0;
+
+static uint32_t latency[LATENCY_SAMPLES];	/* microseconds */
+static unsigned latency_n = 0;			/* samples recorded */
+
+static uint64_t hold_us = 0;		/* completed hold periods */
+static uint64_t hold_since = 0;		/* start of current hold, or 0 */
+
+
+uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void average(double *avg, double sample)
+{
+	*avg = *avg ? *avg * (1 - SMOOTHING) + sample * SMOOTHING : sample;
+}
+
+
+static void add_latency(uint64_t us)
+{
+	latency[latency_n++ % LATENCY_SAMPLES] =
+	    us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+
+/* ----- Recording --------------------------------------------------------- */
+
+
+void metrics_gen(uint32_t lines, uint64_t us)
+{
+	add_latency(us);
+	if (us)
+		average(&gen_lines_s, lines * 1e6 / us);
+}
+
+
+void metrics_verify(uint64_t bytes, uint64_t us)
+{
+	add_latency(us);
+	if (us)
+		average(&verify_bytes_s, bytes * 1e6 / us);
+}
+
+
+void metrics_round(uint64_t us)
+{
+	average(&round_us, us);
+}
+
+
+void metrics_hold(bool holding)
+{
+	if (holding && !hold_since)
+		hold_since = now_us();
+	if (!holding && hold_since) {
+		hold_us += now_us() - hold_since;
+		hold_since = 0;
+	}
+}
+
+
+/* ----- Reporting --------------------------------------------------------- */
+
+
+static int comp_u32(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+
+void metrics_format(char *buf)
+{
+	uint32_t sorted[LATENCY_SAMPLES];
+	unsigned n = latency_n < LATENCY_SAMPLES ?
+	    latency_n : LATENCY_SAMPLES;
+	uint64_t held = hold_us + (hold_since ? now_us() - hold_since : 0);
+	int len;
+
+	len = snprintf(buf, METRICS_MAX_BYTES,
+	    "gen_lines_s=%.0f verify_mb_s=%.1f round_s=%.2f hold_s=%llu",
+	    gen_lines_s, verify_bytes_s / 1e6, round_us / 1e6,
+	    (unsigned long long) (held / 1000000));
+	if (!n)
+		return;
+	memcpy(sorted, latency, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), comp_u32);
+	snprintf(buf + len, METRICS_MAX_BYTES - len,
+	    " latency_ms=%u/%u/%u",
+	    sorted[n / 2] / 1000, sorted[n * 9 / 10] / 1000,
+	    sorted[n * 99 / 100] / 1000);
+}
+
+
+/*
+ * The estimate assumes that the epoch gets all the work from now on, so for
+ * epochs after the current one, it is the time they take once it's their turn.
+ */
+
+int metrics_eta(const struct epoch *e)
+{
+	const struct range *r;
+	uint32_t gen = 0, check = 0;
+	double t = 0;
+
+	if (epoch_done(e))
+		return 0;
+	if (e->nominal > e->pos)
+		check = e->nominal - e->pos;
+	gen = e->lines - (e->nominal > e->pos ? e->nominal : e->pos);
+	for (r = e->bad; r; r = r->next)
+		gen += r->to - r->from;
+	if (check) {
+		double rate = verify_bytes_s;
+
+		if (!rate)
+			return -1;
+		/* background verification is limited to background_mb_s */
+		if (e->check == check_background && background_mb_s &&
+		    background_mb_s * 1e6 < rate)
+			rate = background_mb_s * 1e6;
+		t += check * (double) DAG_LINE_BYTES / rate;
+	}
+	if (gen) {
+		if (!gen_lines_s || (!round_us &&
+		    e->cache.next_round != CACHE_ROUNDS))
+			return -1;
+		t += gen / gen_lines_s;
+		t += (CACHE_ROUNDS - e->cache.next_round) * round_us / 1e6;
+	}
+	return t + 0.5;
+}
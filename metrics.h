@@ -0,0 +1,49 @@
+/*
+ * metrics.h - Performance metrics
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_METRICS_H
+#define	DAGD_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "epoch.h"
+
+
+/*
+ * Monotonic time in microseconds.
+ */
+
+uint64_t now_us(void);
+
+/*
+ * Record a work unit: "lines" generated, or "bytes" verified, in "us"
+ * microseconds, one round of cache calculation, and whether we are holding.
+ * These must only be called from the main thread.
+ */
+
+void metrics_gen(uint32_t lines, uint64_t us);
+void metrics_verify(uint64_t bytes, uint64_t us);
+void metrics_round(uint64_t us);
+void metrics_hold(bool holding);
+
+/*
+ * metrics_format writes the global metrics to "buf", which has room for
+ * METRICS_MAX_BYTES bytes, including the terminating NUL. metrics_eta
+ * estimates the time until the DAG of the epoch is complete, in seconds, or
+ * returns -1 if we don't know yet.
+ */
+
+#define	METRICS_MAX_BYTES	200
+
+void metrics_format(char *buf);
+int metrics_eta(const struct epoch *e);
+
+#endif /* !DAGD_METRICS_H */
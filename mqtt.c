@@ -12,7 +12,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <time.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <mosquitto.h>
 
@@ -21,10 +26,12 @@
 #include "linzhi/dagalgo.h"
 
 #include "debug.h"
+#include "metrics.h"
 #include "mqtt.h"
 
 
-#define	POLL_WAIT_MS		200
+#define	FLUSH_WAIT_MS		200
+#define	MISC_INTERVAL_S		10	/* keepalive and reconnect */
 
 #define	HOLD_STATE		"epoch_upload "
 
@@ -35,6 +42,7 @@
 #define	MQTT_TOPIC_SLOT0_EPOCH	"/mine/0/epoch"
 #define	MQTT_TOPIC_SLOT1_EPOCH	"/mine/1/epoch"
 #define	MQTT_TOPIC_CACHE	"/mine/dag-cache"
+#define	MQTT_TOPIC_METRICS	"/mine/dag-cache/metrics"
 #define	MQTT_TOPIC_SHUTDOWN	"/sys/shutdown"
 #define	MQTT_TOPIC_MINE_STATE	"/mine/+/state"
 #define	MQTT_TOPIC_MINE_STATE_0	"/mine/0/state"
@@ -73,21 +81,35 @@ static bool limit_subscriptions = 0;
 /* ----- MQTT transmission ------------------------------------------------- */
 
 
-void mqtt_status(mqtt_handle mqtt, const char *s, bool flush)
+static void publish(mqtt_handle mqtt, const char *topic, const char *s,
+    time_t *last, bool flush)
 {
-	static time_t last = 0;
 	time_t t;
 	int res;
 
 	time(&t);
-	if (t == last && !flush)	/* rate-limit to ~1 per second */
+	if (t == *last && !flush)	/* rate-limit to ~1 per second */
 		return;
-	last = t;
-	res = mosquitto_publish(mqtt, NULL, MQTT_TOPIC_CACHE, strlen(s), s,
-	    qos_ack, 1);
+	*last = t;
+	res = mosquitto_publish(mqtt, NULL, topic, strlen(s), s, qos_ack, 1);
 	if (res != MOSQ_ERR_SUCCESS)
-		fprintf(stderr, "mosquitto_publish (%s): %d\n",
-		    MQTT_TOPIC_CACHE, res);
+		fprintf(stderr, "mosquitto_publish (%s): %d\n", topic, res);
+}
+
+
+void mqtt_status(mqtt_handle mqtt, const char *s, bool flush)
+{
+	static time_t last = 0;
+
+	publish(mqtt, MQTT_TOPIC_CACHE, s, &last, flush);
+}
+
+
+void mqtt_metrics(mqtt_handle mqtt, const char *s, bool flush)
+{
+	static time_t last = 0;
+
+	publish(mqtt, MQTT_TOPIC_METRICS, s, &last, flush);
 }
 
 
@@ -128,7 +150,7 @@ static void process_epoch(unsigned n, const char *names)
 
 
 static bool hold_slot[2] = { 0, 0 };
-static bool running[2] = { 0, 0 };
+bool running[2] = { 0, 0 };
 
 
 static void update_hold(void)
@@ -386,15 +408,191 @@ static struct mosquitto *setup_mqtt(const char *broker)
 }
 
 
-void mqtt_poll(mqtt_handle mqtt, bool do_wait)
+/* ----- Event loop -------------------------------------------------------- */
+
+
+/*
+ * We wait for MQTT traffic with epoll, on the MQTT socket and on a timer for
+ * mosquitto's housekeeping (keepalive, retransmission, reconnecting). The
+ * socket changes when mosquitto reconnects, so we check it (and whether we
+ * also have to wait for it to become writable) before each wait.
+ */
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static struct watch {
+	int	fd;		/* < 0 if unused */
+	void	(*fn)(int fd);
+} watches[WATCH_MAX];		/* see mqtt_watch */
+static int sock_fd = -1;	/* socket registered with epoll_fd */
+static bool sock_out = 0;	/* waiting for EPOLLOUT */
+
+
+static void watch_socket(mqtt_handle mqtt)
 {
-	int res;
+	struct epoll_event ev = { 0 };
+	int fd = mqtt_fd(mqtt);
+	bool out = fd >= 0 && mosquitto_want_write(mqtt);
 
-	res = mosquitto_loop(mqtt, do_wait ? POLL_WAIT_MS : 0, 1);
+	if (fd == sock_fd && out == sock_out)
+		return;
+	/*
+	 * If mosquitto has closed the old socket, the kernel has already
+	 * removed it from the epoll set, so we ignore errors.
+	 */
+	if (sock_fd >= 0 && fd != sock_fd)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock_fd, NULL);
+	if (fd >= 0) {
+		ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, fd == sock_fd ? EPOLL_CTL_MOD :
+		    EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	sock_fd = fd;
+	sock_out = out;
+}
+
+
+static void mqtt_check(const char *what, int res)
+{
 	if (res < 0) {
-		fprintf(stderr, "mosquitto_loop: %d\n", res);
+		fprintf(stderr, "%s: %d\n", what, res);
+		exit(1);
+	}
+}
+
+
+static void mqtt_misc(mqtt_handle mqtt)
+{
+	uint64_t ticks;
+	int res;
+
+	if (read(timer_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+		perror("timerfd");
+	if (mqtt_fd(mqtt) < 0) {
+		res = mosquitto_reconnect(mqtt);
+		if (res != MOSQ_ERR_SUCCESS)
+			debug(1, "mosquitto_reconnect: %s",
+			    mosquitto_strerror(res));
+		return;
+	}
+	mqtt_check("mosquitto_loop_misc", mosquitto_loop_misc(mqtt));
+}
+
+
+static struct watch *find_watch(int fd)
+{
+	unsigned i;
+
+	for (i = 0; i != WATCH_MAX; i++)
+		if (watches[i].fd == fd)
+			return watches + i;
+	return NULL;
+}
+
+
+static void poll_events(mqtt_handle mqtt, int timeout_ms)
+{
+	struct epoll_event ev[WATCH_MAX + 2];
+	struct watch *w;
+	int n, i;
+
+	watch_socket(mqtt);
+	n = epoll_wait(epoll_fd, ev, WATCH_MAX + 2, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		perror("epoll_wait");
 		exit(1);
 	}
+	for (i = 0; i != n; i++) {
+		if (ev[i].data.fd == timer_fd) {
+			mqtt_misc(mqtt);
+			continue;
+		}
+		/*
+		 * A watched file descriptor may have been closed, and maybe
+		 * even reused, while handling an earlier event.
+		 */
+		w = find_watch(ev[i].data.fd);
+		if (w) {
+			w->fn(w->fd);
+			continue;
+		}
+		/* the socket may have changed while handling the timer */
+		if (ev[i].data.fd != mqtt_fd(mqtt))
+			continue;
+		if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			mqtt_check("mosquitto_loop_read",
+			    mosquitto_loop_read(mqtt, 1));
+		if ((ev[i].events & EPOLLOUT) && mqtt_fd(mqtt) >= 0)
+			mqtt_check("mosquitto_loop_write",
+			    mosquitto_loop_write(mqtt, 1));
+	}
+}
+
+
+void mqtt_poll(mqtt_handle mqtt, bool do_wait)
+{
+	poll_events(mqtt, do_wait ? -1 : 0);
+}
+
+
+void mqtt_wait(mqtt_handle mqtt, unsigned ms)
+{
+	uint64_t end = now_us() + (uint64_t) ms * 1000;
+	int algo = curr_algo;
+	int epoch = curr_epoch;
+	bool held = hold;
+	uint64_t now;
+
+	while (!shutdown_pending && curr_algo == algo &&
+	    curr_epoch == epoch && hold == held) {
+		now = now_us();
+		if (now >= end)
+			break;
+		poll_events(mqtt, (end - now + 999) / 1000);
+	}
+}
+
+
+void mqtt_flush(mqtt_handle mqtt)
+{
+	if (mqtt)
+		mqtt_check("mosquitto_loop",
+		    mosquitto_loop(mqtt, FLUSH_WAIT_MS, 1));
+}
+
+
+bool mqtt_watch(int fd, void (*fn)(int fd))
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct watch *w = find_watch(-1);
+
+	if (!w)
+		return 0;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	w->fd = fd;
+	w->fn = fn;
+	return 1;
+}
+
+
+void mqtt_unwatch(int fd)
+{
+	struct watch *w = find_watch(fd);
+
+	assert(w);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		perror("epoll_ctl");
+	w->fd = -1;
 }
 
 
@@ -404,11 +602,46 @@ int mqtt_fd(mqtt_handle mqtt)
 }
 
 
+static void setup_events(void)
+{
+	struct itimerspec its = {
+		.it_interval	= { .tv_sec = MISC_INTERVAL_S },
+		.it_value	= { .tv_sec = MISC_INTERVAL_S },
+	};
+	struct epoll_event ev = { .events = EPOLLIN };
+	unsigned i;
+
+	for (i = 0; i != WATCH_MAX; i++)
+		watches[i].fd = -1;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	timer_fd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+	ev.data.fd = timer_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+
 /* ----- Initialization ---------------------------------------------------- */
 
 
 mqtt_handle mqtt_init(const char *broker, bool just_one)
 {
 	limit_subscriptions = just_one;
+	setup_events();
 	return setup_mqtt(broker);
 }
@@ -32,11 +32,48 @@ extern int curr_algo;
 extern int curr_epoch;
 extern int alt_epoch;
 extern uint64_t curr_block;
+extern bool running[2];	/* miner state of each slot */
 
 
 void mqtt_status(mqtt_handle mqtt, const char *s, bool flush);
 
+/*
+ * mqtt_metrics publishes performance metrics, see epoch_metrics. Like
+ * mqtt_status, it sends at most about one message per second, unless "flush"
+ * is set.
+ */
+
+void mqtt_metrics(mqtt_handle mqtt, const char *s, bool flush);
+
+/*
+ * mqtt_poll processes pending MQTT traffic. With do_wait, it blocks until
+ * there is some (or until mosquitto needs housekeeping), without a timeout.
+ * mqtt_flush tries to send what is queued, waiting for a short while. It does
+ * nothing if "mqtt" is NULL.
+ */
+
 void mqtt_poll(mqtt_handle mqtt, bool do_wait);
+
+/*
+ * mqtt_wait processes MQTT traffic for "ms" milliseconds, or until a shutdown
+ * is requested or the current algorithm, epoch, or hold state changes.
+ */
+
+void mqtt_wait(mqtt_handle mqtt, unsigned ms);
+void mqtt_flush(mqtt_handle mqtt);
+
+/*
+ * mqtt_watch adds "fd" to the event loop of mqtt_poll and mqtt_wait, which
+ * then call "fn" with "fd" when there is something to read. File descriptors
+ * must be added after mqtt_init. mqtt_watch returns 0 if there are already
+ * WATCH_MAX of them. mqtt_unwatch removes "fd" again, and must be called
+ * before closing it.
+ */
+
+#define	WATCH_MAX	16
+
+bool mqtt_watch(int fd, void (*fn)(int fd));
+void mqtt_unwatch(int fd);
 int mqtt_fd(mqtt_handle mqtt);
 
 mqtt_handle mqtt_init(const char *broker, bool just_one);
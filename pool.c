@@ -0,0 +1,152 @@
+/*
+ * pool.c - Worker thread pool
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "debug.h"
+#include "pool.h"
+
+
+unsigned pool_threads = 1;
+
+static clockid_t *clocks;	/* CPU time clocks of the worker threads */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static void (*run_fn)(void *user, unsigned job);
+static void *run_user;
+static unsigned run_jobs;	/* total number of jobs in this run */
+static unsigned next_job;	/* next job to hand out */
+static unsigned pending;	/* jobs handed out but not yet completed */
+static unsigned generation;	/* incremented for each new run */
+
+
+/* ----- Job dispatch ------------------------------------------------------ */
+
+
+/*
+ * Run jobs until there are none left. Must be called with "lock" held.
+ */
+
+static void run_jobs_locked(void)
+{
+	while (next_job != run_jobs) {
+		unsigned job = next_job++;
+
+		pending++;
+		pthread_mutex_unlock(&lock);
+		run_fn(run_user, job);
+		pthread_mutex_lock(&lock);
+		if (!--pending && next_job == run_jobs)
+			pthread_cond_signal(&done);
+	}
+}
+
+
+static void *worker(void *arg)
+{
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (seen == generation)
+			pthread_cond_wait(&start, &lock);
+		seen = generation;
+		run_jobs_locked();
+	}
+	return NULL;
+}
+
+
+void pool_run(void (*fn)(void *user, unsigned job), void *user, unsigned jobs)
+{
+	if (pool_threads == 1 || jobs == 1) {
+		unsigned i;
+
+		for (i = 0; i != jobs; i++)
+			fn(user, i);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	run_fn = fn;
+	run_user = user;
+	run_jobs = jobs;
+	next_job = 0;
+	generation++;
+	pthread_cond_broadcast(&start);
+	run_jobs_locked();
+	while (pending)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* ----- CPU time --------------------------------------------------------- */
+
+
+static uint64_t clock_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+uint64_t pool_cpu_us(void)
+{
+	uint64_t sum = clock_us(CLOCK_THREAD_CPUTIME_ID);
+	unsigned i;
+
+	for (i = 1; i < pool_threads; i++)
+		sum += clock_us(clocks[i - 1]);
+	return sum;
+}
+
+
+/* ----- Initialization ---------------------------------------------------- */
+
+
+void pool_init(unsigned threads)
+{
+	unsigned i;
+
+	pool_threads = threads ? threads : 1;
+	clocks = alloc_size(sizeof(clockid_t) * pool_threads);
+	for (i = 1; i < pool_threads; i++) {
+		pthread_t thread;
+		int err;
+
+		err = pthread_create(&thread, NULL, worker, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+		err = pthread_getcpuclockid(thread, clocks + i - 1);
+		if (err) {
+			fprintf(stderr, "pthread_getcpuclockid: %s\n",
+			    strerror(err));
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+	debug(1, "pool: %u thread%s", pool_threads,
+	    pool_threads == 1 ? "" : "s");
+}
@@ -0,0 +1,41 @@
+/*
+ * pool.h - Worker thread pool
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_POOL_H
+#define	DAGD_POOL_H
+
+#include <stdint.h>
+
+
+/*
+ * Number of threads working on a pool_run, including the caller. The default
+ * of 1 runs everything on the calling thread.
+ */
+
+extern unsigned pool_threads;
+
+
+/*
+ * pool_run calls fn(user, job) for each job in 0 ... jobs-1, spread over all
+ * threads of the pool, and returns when all jobs have completed. pool_run
+ * must only be called from the main thread.
+ */
+
+void pool_run(void (*fn)(void *user, unsigned job), void *user, unsigned jobs);
+
+/*
+ * pool_cpu_us returns the CPU time used by the calling thread, which must be
+ * the main thread, and by the worker threads, in microseconds.
+ */
+
+uint64_t pool_cpu_us(void);
+
+void pool_init(unsigned threads);
+
+#endif /* !DAGD_POOL_H */
@@ -0,0 +1,189 @@
+/*
+ * prefetch.c - Background calculation of the next epoch's cache
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for SCHED_IDLE */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "linzhi/dag.h"
+#include "linzhi/dagalgo.h"
+
+#include "debug.h"
+#include "mqtt.h"
+#include "cache.h"
+#include "govern.h"
+#include "prefetch.h"
+
+
+#define	NAP_MS	10	/* check for cancellation while pausing */
+
+
+bool prefetch_enabled = 0;
+
+static struct cache cache;	/* cache being prefetched */
+static bool have_cache = 0;	/* "cache" is in use */
+static bool started = 0;	/* thread has not been joined yet */
+static bool cancel;		/* ask the thread to stop */
+static pthread_t thread;
+
+
+static bool cancelled(void)
+{
+	return __atomic_load_n(&cancel, __ATOMIC_RELAXED);
+}
+
+
+static void pause_ms(unsigned ms)
+{
+	struct timespec ts = { .tv_nsec = NAP_MS * 1000000L };
+
+	while (ms && !cancelled()) {
+		if (ms < NAP_MS)
+			ts.tv_nsec = ms * 1000000L;
+		nanosleep(&ts, NULL);
+		ms -= ms < NAP_MS ? ms : NAP_MS;
+	}
+}
+
+
+/*
+ * The thread's CPU time counts against the same budget as that of the main
+ * thread (see govern.h). Loading and storing the cache file are left to the
+ * main thread, which paces them as reading and writing work.
+ */
+
+static void *prefetch_thread(void *arg)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	struct govern_thread gov = { 0 };
+	int err;
+
+	err = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (err)
+		debug(1, "prefetch: SCHED_IDLE: %s", strerror(err));
+	govern_thread_delay_ms(&gov, 0);
+	while (!cancelled() && cache_next_io(&cache) == cache_io_none) {
+		if (!cache_build(&cache))
+			break;
+		pause_ms(govern_thread_delay_ms(&gov, 0));
+	}
+	debug(1, "prefetch: %s epoch %u %s", dagalgo_name(cache.algo),
+	    cache.epoch,
+	    cache.next_round == CACHE_ROUNDS ? "done" : "stopped");
+	return NULL;
+}
+
+
+/*
+ * The thread may be in the middle of a cache round, which we can't interrupt.
+ * At idle priority, it may hardly get any CPU time while the miner is busy, so
+ * we let it finish the round at normal priority.
+ */
+
+static void stop(void)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	int err;
+
+	if (!started)
+		return;
+	__atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+	err = pthread_setschedparam(thread, SCHED_OTHER, &param);
+	if (err)
+		debug(1, "prefetch: SCHED_OTHER: %s", strerror(err));
+	pthread_join(thread, NULL);
+	started = 0;
+}
+
+
+void prefetch_cancel(void)
+{
+	if (!have_cache)
+		return;
+	debug(1, "prefetch: cancel %s epoch %u", dagalgo_name(cache.algo),
+	    cache.epoch);
+	stop();
+	cache_free(&cache);
+	/* no epoch took the cache, so nobody would remove its file */
+	cache_remove(&cache);
+	have_cache = 0;
+}
+
+
+void prefetch_start(uint16_t epoch)
+{
+	enum dag_algo algo = curr_algo;
+	int err;
+
+	if (!prefetch_enabled)
+		return;
+	if (have_cache && cache.algo == algo && cache.epoch == epoch)
+		return;
+	prefetch_cancel();
+
+	debug(1, "prefetch: start %s epoch %u", dagalgo_name(algo), epoch);
+	cache_init(&cache, algo, epoch);
+	cancel = 0;
+	/* only we set dag_algo, and not while the thread is running */
+	dag_algo = algo;
+	err = pthread_create(&thread, NULL, prefetch_thread, NULL);
+	if (err) {
+		fprintf(stderr, "prefetch: pthread_create: %s\n",
+		    strerror(err));
+		return;
+	}
+	have_cache = 1;
+	started = 1;
+}
+
+
+bool prefetch_take(struct cache *c)
+{
+	if (!have_cache || cache.algo != c->algo || cache.epoch != c->epoch)
+		return 0;
+	stop();
+	debug(1, "prefetch: take %s epoch %u (round %u/%u)",
+	    dagalgo_name(cache.algo), cache.epoch, cache.next_round,
+	    CACHE_ROUNDS);
+	cache_free(c);
+	*c = cache;
+	have_cache = 0;
+	return 1;
+}
+
+
+bool prefetch_build(uint16_t epoch)
+{
+	enum dag_algo algo = curr_algo;
+
+	if (have_cache && (cache.algo != algo || cache.epoch != epoch))
+		prefetch_cancel();
+	if (!have_cache) {
+		debug(1, "prefetch: build %s epoch %u", dagalgo_name(algo),
+		    epoch);
+		cache_init(&cache, algo, epoch);
+		have_cache = 1;
+	}
+	if (started || cache_next_io(&cache) != cache_io_none)
+		return 0;
+	dag_algo = algo;
+	return cache_build(&cache);
+}
+
+
+void prefetch_sync(enum dag_algo algo)
+{
+	if (have_cache && cache.algo != algo)
+		prefetch_cancel();
+}
@@ -0,0 +1,63 @@
+/*
+ * prefetch.h - Background calculation of the next epoch's cache
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_PREFETCH_H
+#define	DAGD_PREFETCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "linzhi/dagalgo.h"
+
+#include "cache.h"
+
+
+extern bool prefetch_enabled;
+
+
+/*
+ * prefetch_start begins calculating the cache of the specified epoch of
+ * curr_algo in a low-priority thread. Any prefetch for a different epoch is
+ * abandoned.
+ */
+
+void prefetch_start(uint16_t epoch);
+
+/*
+ * prefetch_take hands over the prefetched cache if it matches the algorithm
+ * and epoch of "c", and returns 1. If the prefetch has not completed yet, it
+ * is stopped after the current step, and cache_build continues from there.
+ * "c" must have just been initialized with cache_init.
+ */
+
+bool prefetch_take(struct cache *c);
+
+/*
+ * prefetch_build performs one step of calculating the cache of the specified
+ * epoch of curr_algo in the calling thread, like cache_build, so that it can
+ * later be taken with prefetch_take. Any prefetch for a different epoch is
+ * abandoned. It returns 0 if the cache is complete, if a prefetch thread is
+ * already working on it, or if the next step would load or store the cache
+ * file. These are left to the epoch that takes the cache.
+ */
+
+bool prefetch_build(uint16_t epoch);
+
+/*
+ * The cache algorithms are selected by the global "dag_algo", which only the
+ * main thread sets, so the prefetch must not run concurrently with work on a
+ * different algorithm. prefetch_sync abandons any prefetch for an algorithm
+ * other than "algo", and must be called before changing dag_algo.
+ */
+
+void prefetch_sync(enum dag_algo algo);
+
+void prefetch_cancel(void);
+
+#endif /* !DAGD_PREFETCH_H */
@@ -0,0 +1,106 @@
+/*
+ * range.c - Sorted lists of line ranges
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "linzhi/alloc.h"
+
+#include "range.h"
+
+
+void range_add(struct range **list, uint32_t from, uint32_t to)
+{
+	struct range **anchor;
+	struct range *r, *next;
+
+	if (from >= to)
+		return;
+	for (anchor = list; *anchor; anchor = &(*anchor)->next)
+		if ((*anchor)->to >= from)
+			break;
+	r = *anchor;
+	if (!r || r->from > to) {
+		r = alloc_type(struct range);
+		r->from = from;
+		r->to = to;
+		r->next = *anchor;
+		*anchor = r;
+		return;
+	}
+	if (r->from > from)
+		r->from = from;
+	if (r->to < to)
+		r->to = to;
+	while (r->next && r->next->from <= r->to) {
+		next = r->next;
+		if (r->to < next->to)
+			r->to = next->to;
+		r->next = next->next;
+		free(next);
+	}
+}
+
+
+void range_remove(struct range **list, uint32_t from, uint32_t to)
+{
+	struct range **anchor = list;
+	struct range *r, *split;
+
+	while ((r = *anchor) && r->from < to) {
+		if (r->to <= from) {
+			anchor = &r->next;
+			continue;
+		}
+		if (r->from >= from && r->to <= to) {
+			*anchor = r->next;
+			free(r);
+			continue;
+		}
+		if (r->from < from && r->to > to) {
+			split = alloc_type(struct range);
+			split->from = to;
+			split->to = r->to;
+			split->next = r->next;
+			r->to = from;
+			r->next = split;
+			return;
+		}
+		if (r->from < from)
+			r->to = from;
+		else
+			r->from = to;
+		anchor = &r->next;
+	}
+}
+
+
+unsigned range_count(const struct range *list)
+{
+	unsigned n = 0;
+
+	while (list) {
+		n++;
+		list = list->next;
+	}
+	return n;
+}
+
+
+void range_free(struct range **list)
+{
+	struct range *next;
+
+	while (*list) {
+		next = (*list)->next;
+		free(*list);
+		*list = next;
+	}
+}
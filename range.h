@@ -0,0 +1,40 @@
+/*
+ * range.h - Sorted lists of line ranges
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_RANGE_H
+#define	DAGD_RANGE_H
+
+#include <stdint.h>
+
+
+/*
+ * Ranges in a list are sorted, non-empty, and neither overlap nor touch each
+ * other.
+ */
+
+struct range {
+	uint32_t	from;	/* first line */
+	uint32_t	to;	/* line after the last one */
+	struct range	*next;
+};
+
+
+/*
+ * range_add adds [from, to) to the list, merging it with ranges it overlaps
+ * or touches. range_remove removes [from, to) from all the ranges in the list,
+ * splitting them if necessary.
+ */
+
+void range_add(struct range **list, uint32_t from, uint32_t to);
+void range_remove(struct range **list, uint32_t from, uint32_t to);
+
+unsigned range_count(const struct range *list);
+void range_free(struct range **list);
+
+#endif /* !DAGD_RANGE_H */
@@ -0,0 +1,214 @@
+/*
+ * sha3.c - SHA3-256 with multi-buffer SIMD backends
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Vector backends use GCC's generic vector extensions, which map to SSE2 or
+ * AVX2 on x86, and to NEON on ARM. Each vector element is the state of a
+ * different buffer, so the permutation itself is the same code for all
+ * backends.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha3.h"
+
+
+#define	KECCAK_ROUNDS	24
+#define	SHA3_RATE	(200 - 2 * SHA3_256_BYTES)	/* 136 bytes */
+
+#define	ROL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+
+struct sha3_backend {
+	const char	*name;
+	unsigned	lanes;
+	void (*fn)(uint8_t *const res[], const uint8_t *const data[],
+	    size_t len);
+	bool (*usable)(void);
+};
+
+
+unsigned sha3_lanes = 1;
+
+static const struct sha3_backend *backend;
+
+
+static const uint64_t keccak_rc[KECCAK_ROUNDS] = {
+	0x0000000000000001, 0x0000000000008082, 0x800000000000808a,
+	0x8000000080008000, 0x000000000000808b, 0x0000000080000001,
+	0x8000000080008081, 0x8000000000008009, 0x000000000000008a,
+	0x0000000000000088, 0x0000000080008009, 0x000000008000000a,
+	0x000000008000808b, 0x800000000000008b, 0x8000000000008089,
+	0x8000000000008003, 0x8000000000008002, 0x8000000000000080,
+	0x000000000000800a, 0x800000008000000a, 0x8000000080008081,
+	0x8000000000008080, 0x0000000080000001, 0x8000000080008008
+};
+
+static inline uint64_t le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+
+static inline void put_le64(uint8_t *p, uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(p, &v, 8);
+}
+
+
+/* ----- Backends ---------------------------------------------------------- */
+
+
+static bool always(void)
+{
+	return 1;
+}
+
+
+#define	KECCAK_T		uint64_t
+#define	KECCAK_LANES		1
+#define	KECCAK_NAME(name)	name##_scalar
+#define	KECCAK_ATTR
+#include "keccak.inc"
+#undef KECCAK_T
+#undef KECCAK_LANES
+#undef KECCAK_NAME
+#undef KECCAK_ATTR
+
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+#define	HAVE_VEC128
+
+#ifdef __ARM_NEON
+#define	VEC128_NAME	"neon"
+#else
+#define	VEC128_NAME	"sse2"
+#endif
+
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+
+#define	KECCAK_T		v2u64
+#define	KECCAK_LANES		2
+#define	KECCAK_NAME(name)	name##_vec128
+#define	KECCAK_ATTR
+#include "keccak.inc"
+#undef KECCAK_T
+#undef KECCAK_LANES
+#undef KECCAK_NAME
+#undef KECCAK_ATTR
+
+#endif /* __SSE2__ || __ARM_NEON */
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define	HAVE_AVX2
+
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+#define	KECCAK_T		v4u64
+#define	KECCAK_LANES		4
+#define	KECCAK_NAME(name)	name##_avx2
+#define	KECCAK_ATTR		__attribute__((target("avx2")))
+#include "keccak.inc"
+#undef KECCAK_T
+#undef KECCAK_LANES
+#undef KECCAK_NAME
+#undef KECCAK_ATTR
+
+
+static bool have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif /* __x86_64__ || __i386__ */
+
+
+/*
+ * Ordered from slowest to fastest.
+ */
+
+static const struct sha3_backend backends[] = {
+	{ "scalar",	1,	sha3_256_scalar,	always },
+#ifdef HAVE_VEC128
+	{ VEC128_NAME,	2,	sha3_256_vec128,	always },
+#endif
+#ifdef HAVE_AVX2
+	{ "avx2",	4,	sha3_256_avx2,		have_avx2 },
+#endif
+};
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+void sha3_256(uint8_t res[SHA3_256_BYTES], const void *data, size_t len)
+{
+	uint8_t *const r[1] = { res };
+	const uint8_t *const d[1] = { data };
+
+	sha3_256_scalar(r, d, len);
+}
+
+
+void sha3_256_lanes(uint8_t *const res[], const void *const data[],
+    size_t len)
+{
+	if (!backend)
+		sha3_select(NULL);
+	backend->fn(res, (const uint8_t *const *) data, len);
+}
+
+
+bool sha3_select(const char *name)
+{
+	const struct sha3_backend *b;
+
+	for (b = backends + sizeof(backends) / sizeof(*backends) - 1;
+	    b >= backends; b--) {
+		if (name && strcmp(b->name, name))
+			continue;
+		if (!b->usable())
+			continue;
+		backend = b;
+		sha3_lanes = b->lanes;
+		return 1;
+	}
+	return 0;
+}
+
+
+const char *sha3_backend(void)
+{
+	if (!backend)
+		sha3_select(NULL);
+	return backend->name;
+}
+
+
+const char *sha3_backend_name(unsigned n)
+{
+	return n < sizeof(backends) / sizeof(*backends) ?
+	    backends[n].name : NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * sha3.h - SHA3-256 with multi-buffer SIMD backends
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DAGD_SHA3_H
+#define	DAGD_SHA3_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define	SHA3_256_BYTES	32
+#define	SHA3_LANES_MAX	4
+
+
+/*
+ * Number of buffers the selected backend hashes in parallel. sha3_256_lanes
+ * takes exactly this number of buffers, all of the same length.
+ */
+
+extern unsigned sha3_lanes;
+
+
+void sha3_256(uint8_t res[SHA3_256_BYTES], const void *data, size_t len);
+void sha3_256_lanes(uint8_t *const res[], const void *const data[],
+    size_t len);
+
+/*
+ * sha3_select selects the backend with the given name, or the fastest one the
+ * CPU supports if "name" is NULL. It returns 0 if there is no usable backend
+ * with that name.
+ */
+
+bool sha3_select(const char *name);
+const char *sha3_backend(void);
+
+/*
+ * sha3_backend_name returns the name of the n-th built-in backend (whether
+ * usable or not), or NULL if there are fewer than n + 1 backends.
+ */
+
+const char *sha3_backend_name(unsigned n);
+
+#endif /* !DAGD_SHA3_H */